@@ -0,0 +1,266 @@
+/* Benchmark driver, built and run by "make bench" */
+/* Runs each workload a number of times in a fresh interpreter, reporting */
+/* the median and 95th percentile wall time, peak RSS and the number of */
+/* allocations as JSON. Given a baseline in the same format, any workload */
+/* that got slower or allocates more than it allows is reported and the */
+/* driver exits with failure. */
+/* */
+/* usage: sneed_bench [-n runs] [-i interpreter] [-a interpreter-arg]... */
+/*                    [-b baseline.json] [-t tolerance%] [-o out.json] workload.snd... */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+/* Gaps smaller than this are noise however large they are relatively */
+#define BENCH_MIN_MS 2.0
+
+#define BENCH_MAX_ARGS 16
+
+typedef struct {
+  char name[64];
+  double median_ms;
+  double p95_ms;
+  long max_rss_kb;
+  long allocations;
+} bench_result;
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* The workload's name is its file name without the directory or .snd */
+static void bench_name(char* out, const char* path) {
+  const char* s = strrchr(path, '/');
+  s = s ? s + 1 : path;
+  snprintf(out, 64, "%s", s);
+  char* dot = strrchr(out, '.');
+  if (dot) { *dot = '\0'; }
+}
+
+/* Run the interpreter once, as given by the NULL terminated argv. */
+/* Returns 0 on success, filling in the time, peak RSS and allocations. */
+static int bench_run(char** argv, double* ms, long* rss, long* allocations) {
+  int fds[2];
+  if (pipe(fds) != 0) { return -1; }
+
+  double start = now_ms();
+  pid_t pid = fork();
+  if (pid < 0) { return -1; }
+  if (pid == 0) {
+    dup2(fds[1], STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) { dup2(null, STDERR_FILENO); }
+    close(fds[0]);
+    close(fds[1]);
+    execv(argv[0], argv);
+    _exit(127);
+  }
+  close(fds[1]);
+
+  /* Drain the output, keeping the tail where the stats are printed */
+  static char tail[8192];
+  size_t used = 0;
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+    if (used + n >= sizeof(tail)) {
+      size_t keep = sizeof(tail) / 2;
+      if (used > keep) {
+        memmove(tail, tail + used - keep, keep);
+        used = keep;
+      }
+      if ((size_t)n >= sizeof(tail) - used) { used = 0; }
+    }
+    memcpy(tail + used, buf, n);
+    used += n;
+  }
+  tail[used] = '\0';
+  close(fds[0]);
+
+  int status;
+  struct rusage ru;
+  if (wait4(pid, &status, 0, &ru) < 0) { return -1; }
+  *ms = now_ms() - start;
+  *rss = ru.ru_maxrss;
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) { return -1; }
+  char* a = strstr(tail, "{allocations ");
+  if (!a) { return -1; }
+  *allocations = strtol(a + strlen("{allocations "), NULL, 10);
+  return 0;
+}
+
+static int cmp_double(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+/* args holds the interpreter and its options, with room after them for the */
+/* workload, the stats file and the terminating NULL */
+static int bench_workload(char** args, int nargs, char* path, char* stats,
+    int runs, bench_result* r) {
+  double* times = malloc(sizeof(double) * runs);
+  bench_name(r->name, path);
+  r->max_rss_kb = 0;
+  args[nargs] = path;
+  args[nargs + 1] = stats;
+  args[nargs + 2] = NULL;
+
+  /* One run first to warm the file cache, which is not counted */
+  double ms;
+  long rss, allocations;
+  if (bench_run(args, &ms, &rss, &allocations) != 0) {
+    fprintf(stderr, "%s: the workload failed to run\n", r->name);
+    free(times);
+    return -1;
+  }
+  r->allocations = allocations;
+
+  for (int i = 0; i < runs; i++) {
+    if (bench_run(args, &times[i], &rss, &allocations) != 0) {
+      fprintf(stderr, "%s: the workload failed to run\n", r->name);
+      free(times);
+      return -1;
+    }
+    if (rss > r->max_rss_kb) { r->max_rss_kb = rss; }
+  }
+
+  qsort(times, runs, sizeof(double), cmp_double);
+  r->median_ms = runs % 2 ? times[runs/2] : (times[runs/2 - 1] + times[runs/2]) / 2;
+  int p = (runs * 95 + 99) / 100 - 1;
+  r->p95_ms = times[p < 0 ? 0 : p];
+  free(times);
+  return 0;
+}
+
+static void bench_write(FILE* f, bench_result* rs, int count, int runs) {
+  fprintf(f, "{\n  \"runs\": %d,\n  \"workloads\": [\n", runs);
+  for (int i = 0; i < count; i++) {
+    fprintf(f, "    {\"name\": \"%s\", \"median_ms\": %.3f, \"p95_ms\": %.3f, "
+      "\"max_rss_kb\": %ld, \"allocations\": %ld}%s\n",
+      rs[i].name, rs[i].median_ms, rs[i].p95_ms, rs[i].max_rss_kb, rs[i].allocations,
+      i + 1 < count ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+}
+
+/* Find the baseline line for a workload, as written by bench_write */
+static int bench_find(FILE* f, const char* name, bench_result* out) {
+  char line[1024], key[96];
+  snprintf(key, sizeof(key), "{\"name\": \"%s\",", name);
+  rewind(f);
+  while (fgets(line, sizeof(line), f)) {
+    char* s = strstr(line, key);
+    if (!s) { continue; }
+    return sscanf(s + strlen(key),
+      " \"median_ms\": %lf, \"p95_ms\": %lf, \"max_rss_kb\": %ld, \"allocations\": %ld",
+      &out->median_ms, &out->p95_ms, &out->max_rss_kb, &out->allocations) == 4 ? 0 : -1;
+  }
+  return -1;
+}
+
+/* Compare against the baseline, returning the number of regressions */
+static int bench_compare(FILE* f, bench_result* rs, int count, double tolerance) {
+  int regressions = 0;
+  for (int i = 0; i < count; i++) {
+    bench_result b;
+    if (bench_find(f, rs[i].name, &b) != 0) {
+      fprintf(stderr, "%-12s no baseline\n", rs[i].name);
+      continue;
+    }
+
+    double limit = b.median_ms * (1 + tolerance / 100);
+    if (limit < b.median_ms + BENCH_MIN_MS) { limit = b.median_ms + BENCH_MIN_MS; }
+    int slower = rs[i].median_ms > limit;
+    int allocates = rs[i].allocations > b.allocations + b.allocations / 100;
+
+    fprintf(stderr, "%-12s %9.2f ms (baseline %9.2f ms, %+6.1f%%) %11ld allocations (baseline %11ld) %s\n",
+      rs[i].name, rs[i].median_ms, b.median_ms,
+      b.median_ms > 0 ? (rs[i].median_ms / b.median_ms - 1) * 100 : 0,
+      rs[i].allocations, b.allocations,
+      slower || allocates ? "REGRESSION" : "ok");
+    regressions += slower || allocates;
+  }
+  return regressions;
+}
+
+int main(int argc, char** argv) {
+  int runs = 10;
+  char* args[BENCH_MAX_ARGS + 3] = { "bin/sneed_standalone" };
+  int nargs = 1;
+  char* baseline = NULL;
+  char* out = NULL;
+  double tolerance = 25;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:i:a:b:t:o:")) != -1) {
+    switch (opt) {
+      case 'n': runs = atoi(optarg); break;
+      case 'i': args[0] = optarg; break;
+      case 'a':
+        if (nargs == BENCH_MAX_ARGS) { fprintf(stderr, "%s: too many interpreter arguments\n", argv[0]); return 2; }
+        args[nargs++] = optarg;
+        break;
+      case 'b': baseline = optarg; break;
+      case 't': tolerance = atof(optarg); break;
+      case 'o': out = optarg; break;
+      default:
+        fprintf(stderr, "usage: %s [-n runs] [-i interpreter] [-a interpreter-arg]... "
+          "[-b baseline.json] [-t tolerance%%] [-o out.json] workload.snd...\n", argv[0]);
+        return 2;
+    }
+  }
+  if (optind == argc || runs < 1) {
+    fprintf(stderr, "%s: no workloads given\n", argv[0]);
+    return 2;
+  }
+
+  /* The stats are printed by a file run after each workload */
+  char stats[] = "/tmp/sneed_bench_XXXXXX";
+  int fd = mkstemp(stats);
+  if (fd < 0) { perror("mkstemp"); return 2; }
+  const char* expr = "(print (gc-stats ()))\n";
+  if (write(fd, expr, strlen(expr)) < 0) { perror("write"); return 2; }
+  close(fd);
+
+  int count = argc - optind;
+  bench_result* rs = malloc(sizeof(bench_result) * count);
+  int failed = 0;
+  for (int i = 0; i < count; i++) {
+    fprintf(stderr, "running %s\n", argv[optind + i]);
+    if (bench_workload(args, nargs, argv[optind + i], stats, runs, &rs[i]) != 0) { failed = 1; }
+  }
+  unlink(stats);
+
+  /* and so is the cache load keeps of it */
+  char cache[sizeof(stats) + 1];
+  snprintf(cache, sizeof(cache), "%sc", stats);
+  unlink(cache);
+
+  FILE* f = out ? fopen(out, "w") : stdout;
+  if (!f) { perror(out); return 2; }
+  bench_write(f, rs, count, runs);
+  if (out) { fclose(f); }
+
+  if (baseline && !failed) {
+    FILE* b = fopen(baseline, "r");
+    if (!b) { perror(baseline); return 2; }
+    int regressions = bench_compare(b, rs, count, tolerance);
+    fclose(b);
+    if (regressions) {
+      fprintf(stderr, "%d workload(s) regressed against %s\n", regressions, baseline);
+      failed = 1;
+    }
+  }
+
+  free(rs);
+  return failed;
+}
@@ -0,0 +1,74 @@
+/* Embedding benchmark, built and run by "make bench-embed" */
+/* Times evaluating the same call many times through libsneed: from source */
+/* each time, from an expression read once, and all at once in a batch. */
+/* */
+/* usage: sneed_embed [calls] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../src/sneed.h"
+
+static double now_ms(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void report(const char* how, int calls, double ms, long check) {
+  printf("%-10s %8.1f ms %8.2f us/call (sum %ld)\n", how, ms, ms * 1e3 / calls, check);
+}
+
+int main(int argc, char** argv) {
+  int calls = argc > 1 ? atoi(argv[1]) : 100000;
+  if (calls < 1) { fprintf(stderr, "%s: no calls to make\n", argv[0]); return 2; }
+
+  sneed* s = sneed_new();
+  sneed_val* r = sneed_load(s, "src/prelude.snd");
+  if (sneed_type(r) == SNEED_ERROR) { fprintf(stderr, "%s\n", sneed_to_string(r)); return 1; }
+  sneed_release(r);
+
+  const char* source = "(foldleft + 0 (map (\\ {x} {* x x}) {1 2 3 4 5 6 7 8}))";
+  sneed_val* code = sneed_read(s, "bench", source);
+  sneed_val* expr = sneed_item(code, 0);
+  sneed_release(code);
+
+  /* From source every time */
+  long sum = 0;
+  double start = now_ms();
+  for (int i = 0; i < calls; i++) {
+    r = sneed_eval(s, "bench", source);
+    sum += sneed_to_number(r);
+    sneed_release(r);
+  }
+  report("source", calls, now_ms() - start, sum);
+
+  /* From the expression read once */
+  sum = 0;
+  start = now_ms();
+  for (int i = 0; i < calls; i++) {
+    r = sneed_eval_value(s, expr);
+    sum += sneed_to_number(r);
+    sneed_release(r);
+  }
+  report("read-once", calls, now_ms() - start, sum);
+
+  /* All at once */
+  sneed_val** exprs = malloc(sizeof(sneed_val*) * calls);
+  sneed_val** results = malloc(sizeof(sneed_val*) * calls);
+  for (int i = 0; i < calls; i++) { exprs[i] = expr; }
+  sum = 0;
+  start = now_ms();
+  int errors = sneed_eval_batch(s, exprs, calls, results);
+  for (int i = 0; i < calls; i++) {
+    sum += sneed_to_number(results[i]);
+    sneed_release(results[i]);
+  }
+  report("batch", calls, now_ms() - start, sum);
+
+  free(exprs);
+  free(results);
+  sneed_release(expr);
+  sneed_free(s);
+  sneed_thread_cleanup();
+  return errors ? 1 : 0;
+}
@@ -1,6 +1,22 @@
-#include "mpc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "sneed.h"
+
+/* The library (-DSNEED_LIBRARY) has no prompt, so needs no readline */
+#ifdef SNEED_LIBRARY
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
-#ifdef _WIN32
+#elif defined(_WIN32)
 static char buffer[2048];
 
 char* readline(char* prompt) {
@@ -17,187 +33,838 @@ void add_history(char* unused) {}
 #else
 #include <readline/readline.h> // Needs to be fixed
 #include <readline/history.h> // Likewise
+#include <unistd.h>
 #endif
 
-/* Parser Declarations */
-mpc_parser_t* Number;
-mpc_parser_t* Symbol;
-mpc_parser_t* String;
-mpc_parser_t* Comment;
-mpc_parser_t* Sexpr;
-mpc_parser_t* Qexpr;
-mpc_parser_t* Expr;
-mpc_parser_t* Sneed;
+/* getpid, to name the load cache's temporary files */
+#ifdef _WIN32
+#include <process.h>
+#endif
 
 /* Forward Declarations */
 struct lval;
 struct lenv;
+struct lcode;
+struct lcells;
+struct lchars;
+struct lmap;
+struct lmemo;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
+typedef struct lcells lcells;
+typedef struct lchars lchars;
+typedef struct lmap lmap;
+typedef struct lmemo lmemo;
 
 /* Possible Lisp Evaluation types */
-enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_STR, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR };
+enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_STR, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_VEC, LVAL_MAP };
 
 /* Builtin function type */
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+/* Values are shared by reference count and treated as immutable once shared. */
+/* Code that needs to modify a value in place calls lval_mut first. */
+/* Only the fields for the value's type are stored, in a union. */
 struct lval {
 	int type;
+	int refs;
+
+	union {
+		/* Number, only for those too large to be a fixnum */
+		long num;
+
+		/* Error */
+		char* err;
+
+		/* String, size bytes of text starting at str, which points into */
+		/* the storage holding it */
+		struct {
+			char* str;
+			long size;
+			lchars* chars;
+		};
+
+		/* Symbol, and the frame slot it is bound to, filled in when a lambda is built (-1 if unknown) */
+		struct {
+			char* sym;
+			int slot;
+		};
+
+		/* Function. A builtin has builtin set and a lambda its formals. A */
+		/* memoized function has neither, and its cache of results in place */
+		/* of an environment. name is the one it was first defined under */
+		/* (NULL if it has none yet). */
+		struct {
+			lbuiltin builtin;
+			union {
+				lenv* env;
+				lmemo* memo;
+			};
+			lval* formals;
+			lval* body;
+			char* name;
+		};
+
+		/* Expression */
+		/* Count and Pointer to a list of "lval*", which points into the */
+		/* storage holding them (NULL while empty); and the bytecode it */
+		/* compiles to, once it has been evaluated while shared */
+		struct {
+			int count;
+			lval** cell;
+			lcode* code;
+			lcells* cells;
+		};
+
+		/* Vector, len packed 64 bit integers */
+		struct {
+			int64_t* data;
+			long len;
+		};
+
+		/* Map, the first upto entries of the table holding it, of which */
+		/* keys are live */
+		struct {
+			lmap* map;
+			int upto;
+			int keys;
+		};
+	};
+};
+
+/* List Storage */
+/* The elements of a list live in storage that can be shared with other */
+/* lists, so taking the tail of a list is a new view into the same storage. */
+/* The storage holds a reference to each of items[0..used), and each list */
+/* views a run of them. Only a list that is the sole user of its storage */
+/* may modify it, but any list whose view ends at used may add elements */
+/* after it, since no other list can see that far. Spare room is kept at */
+/* the end for appends and, after a prepend, at the start. */
+struct lcells {
+	int refs;
+	int used;
+	int cap;
+	lval* items[];
+};
+
+/* String Storage */
+/* The text of a string lives in storage that can be shared with other */
+/* strings, so a substring is a new view into the same text. Text is never */
+/* changed once written, but as with list storage, a string whose view ends */
+/* at used may add text after it, which makes building a string up by */
+/* concatenation take amortized linear time. A NUL is kept after used, so */
+/* a string ending there can be passed to C as it is. */
+struct lchars {
+	int refs;
+	long used;
+	long cap;
+	char text[];
+};
 
-	/* Basic */
-	long num;
-	char* err;
-	char* sym;
-	char* str;
-
-	/* Function */
-	lbuiltin builtin;
-	lenv* env;
-	lval* formals;
-	lval* body;
-
-	/* Expression */
-	/* Count and Pointer to a list of "lval*"; */
-	int count;
-	lval** cell;
+/* Map Storage */
+/* A map's entries live in a table that can be shared with other maps. */
+/* Entries are only ever added, in order, each putting or deleting one key, */
+/* and a map sees the first upto of them. As with list storage, a map */
+/* whose view ends at used may add entries after it, so building a map up */
+/* takes constant time per key even while older versions are still in use. */
+/* Each entry links to the entries before and after it for the same key, */
+/* and slots, an open addressing index by hash, holds the latest entry for */
+/* each key, so a lookup follows prev back to the last entry the map sees. */
+typedef struct {
+	lval* key;
+	lval* val;		// NULL where the key was deleted
+	unsigned long hash;
+	int prev;		// the entry this replaced for the same key, or -1
+	int next;		// the entry that replaced this, or -1
+} lmap_entry;
+
+struct lmap {
+	int refs;
+	int used;
+	int cap;
+	int mask;
+	int* slots;
+	lmap_entry entries[];
 };
 
+/* Fixnums */
+/* Most numbers are stored in the lval* itself, shifted up one bit with the low */
+/* bit set. Heap values are always aligned so their low bit is clear. Use */
+/* lval_type and lval_to_num rather than reading type and num directly. */
+#define LVAL_FIXNUM_MIN (LONG_MIN / 2)
+#define LVAL_FIXNUM_MAX (LONG_MAX / 2)
+
+static inline int lval_is_fixnum(lval* v) { return ((uintptr_t)v & 1) != 0; }
+
+static inline int lval_type(lval* v) { return lval_is_fixnum(v) ? LVAL_NUM : v->type; }
+
+/* True if the function v is memoized */
+static inline int lval_is_memo(lval* v) { return !v->builtin && !v->formals; }
+
+static inline long lval_to_num(lval* v) {
+	return lval_is_fixnum(v) ? (long)((intptr_t)v >> 1) : v->num;
+}
+
+/* Memory Pools */
+/* Values, environments and small arrays come from per-thread free lists, one */
+/* per 16 byte size class, refilled a slab at a time. Larger blocks go straight */
+/* to malloc. Build with -DSNEED_MALLOC to use malloc for everything instead, */
+/* which lets tools such as AddressSanitizer see each object. */
+#define LMEM_STEP 16
+#define LMEM_CLASSES 16
+#define LMEM_MAX (LMEM_STEP * LMEM_CLASSES)
+#define LMEM_SLAB 65536
+
+typedef struct lmem_block { struct lmem_block* next; } lmem_block;
+
+static _Thread_local lmem_block* lmem_free_list[LMEM_CLASSES];
+static _Thread_local lmem_block* lmem_slabs = NULL;
+
+/* Counters for this thread */
+static _Thread_local unsigned long lmem_allocs = 0;
+static _Thread_local unsigned long lmem_frees = 0;
+static _Thread_local unsigned long lmem_slab_count = 0;
+static _Thread_local long lmem_bytes = 0; // requested bytes currently in use
+
+/* Memory Accounting */
+/* Values are counted by their type, and environments and list storage each */
+/* as a kind of their own, so the memory in use can be broken down and a leak */
+/* traced to the kind of object leaked. The bytes of a kind include what its */
+/* objects own alone, such as the text of a string. Read with mem-stats. */
+enum { LMEM_ENV = LVAL_MAP + 1, LMEM_CELLS, LMEM_CHARS, LMEM_TABLE, LMEM_KINDS };
+
+typedef struct {
+  unsigned long allocs;
+  unsigned long frees;
+  long live;
+  long bytes;
+} lmem_count;
+
+static _Thread_local lmem_count lmem_counts[LMEM_KINDS];
+static _Thread_local long lmem_counted = 0; // bytes in use across every kind
+static _Thread_local long lmem_peak = 0;
+
+static inline void lmem_count_bytes(int kind, long n) {
+  lmem_counts[kind].bytes += n;
+  lmem_counted += n;
+  if (lmem_counted > lmem_peak) { lmem_peak = lmem_counted; }
+}
+
+static inline void lmem_count_new(int kind, long n) {
+  lmem_counts[kind].allocs++;
+  lmem_counts[kind].live++;
+  lmem_count_bytes(kind, n);
+}
+
+static inline void lmem_count_del(int kind, long n) {
+  lmem_counts[kind].frees++;
+  lmem_counts[kind].live--;
+  lmem_count_bytes(kind, -n);
+}
+
+/* Change the type of a list in place. It is counted as live under its new */
+/* type, but its allocation and free stay with the types it had then. */
+static inline void lval_retype(lval* v, int type) {
+  if (v->type == type) { return; }
+  lmem_counts[v->type].live--;
+  lmem_counts[v->type].bytes -= sizeof(lval);
+  lmem_counts[type].live++;
+  lmem_counts[type].bytes += sizeof(lval);
+  v->type = type;
+}
+
+/* Bytes held by v beyond the lval itself */
+static long lval_owned_bytes(lval* v) {
+  switch (v->type) {
+    case LVAL_ERR: return strlen(v->err) + 1;
+    case LVAL_VEC: return sizeof(int64_t) * (v->len ? v->len : 1);
+  }
+  return 0;
+}
+
+#ifndef SNEED_MALLOC
+static int lmem_class(size_t n) { return (int)((n - 1) / LMEM_STEP); }
+
+/* Carve a new slab into blocks of size class c */
+static void lmem_refill(int c) {
+  size_t size = (size_t)(c + 1) * LMEM_STEP;
+  lmem_block* slab = malloc(LMEM_SLAB);
+  slab->next = lmem_slabs;
+  lmem_slabs = slab;
+  lmem_slab_count++;
+
+  /* The first block holds the slab list link */
+  for (char* p = (char*)slab + LMEM_STEP; p + size <= (char*)slab + LMEM_SLAB; p += size) {
+    lmem_block* b = (lmem_block*)p;
+    b->next = lmem_free_list[c];
+    lmem_free_list[c] = b;
+  }
+}
+#endif
+
+void* lmem_alloc(size_t n) {
+  if (n == 0) { return NULL; }
+  lmem_allocs++;
+  lmem_bytes += n;
+#ifdef SNEED_MALLOC
+  return malloc(n);
+#else
+  if (n > LMEM_MAX) { return malloc(n); }
+  int c = lmem_class(n);
+  if (!lmem_free_list[c]) { lmem_refill(c); }
+  lmem_block* b = lmem_free_list[c];
+  lmem_free_list[c] = b->next;
+  return b;
+#endif
+}
+
+/* Free a block, n must be the size it was allocated (or last reallocated) with */
+void lmem_free(void* p, size_t n) {
+  if (!p) { return; }
+  lmem_frees++;
+  lmem_bytes -= n;
+#ifdef SNEED_MALLOC
+  free(p);
+#else
+  if (n > LMEM_MAX) { free(p); return; }
+  int c = lmem_class(n);
+  lmem_block* b = p;
+  b->next = lmem_free_list[c];
+  lmem_free_list[c] = b;
+#endif
+}
+
+void* lmem_realloc(void* p, size_t old, size_t n) {
+#ifdef SNEED_MALLOC
+  if (n == 0) { lmem_free(p, old); return NULL; }
+  if (!p) { lmem_allocs++; }
+  lmem_bytes += (long)n - (long)old;
+  return realloc(p, n);
+#else
+  /* Blocks that stay within one size class do not move */
+  if (p && n && old <= LMEM_MAX && n <= LMEM_MAX && lmem_class(old) == lmem_class(n)) {
+    lmem_bytes += (long)n - (long)old;
+    return p;
+  }
+  if (p && old > LMEM_MAX && n > LMEM_MAX) {
+    lmem_bytes += (long)n - (long)old;
+    return realloc(p, n);
+  }
+
+  void* q = lmem_alloc(n);
+  if (p && q) { memcpy(q, p, old < n ? old : n); }
+  lmem_free(p, old);
+  return q;
+#endif
+}
+
+/* Return this thread's slabs to the system, once none of their blocks are in use */
+void lmem_cleanup(void) {
+  while (lmem_slabs) {
+    lmem_block* next = lmem_slabs->next;
+    free(lmem_slabs);
+    lmem_slabs = next;
+  }
+  for (int i = 0; i < LMEM_CLASSES; i++) { lmem_free_list[i] = NULL; }
+  lmem_slab_count = 0;
+}
+
+/* Reclamation */
+/* Reference counting frees values without tracing, and values cannot form */
+/* cycles since a shared value is never modified. A value whose last reference */
+/* is dropped is queued rather than freed on the spot. The queue is drained a */
+/* few values per allocation, so freed blocks are reused straight away, and in */
+/* full once it grows past a threshold. Freeing is iterative, so dropping a huge */
+/* or deeply nested list can neither overflow the C stack nor stall one call. */
+static _Thread_local lval** lgc_dead = NULL;
+static _Thread_local long lgc_dead_count = 0;
+static _Thread_local long lgc_dead_cap = 0;
+static _Thread_local int lgc_busy = 0;
+
+/* Tunables, set with gc-tune */
+static _Thread_local long lgc_threshold = 65536; // queued values that force a full collection
+static _Thread_local long lgc_step = 4;          // values reclaimed per allocation
+
+/* Statistics, read with gc-stats */
+static _Thread_local unsigned long lgc_collections = 0;
+static _Thread_local unsigned long lgc_reclaimed = 0;
+static _Thread_local long lgc_live = 0;
+static _Thread_local double lgc_pause_total = 0; // microseconds
+static _Thread_local double lgc_pause_max = 0;
+
+static double lgc_now_us(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void lgc_collect(long limit);
+
+/* Allocate a heap lval with one reference */
+static lval* lval_alloc(int type) {
+  if (lgc_dead_count && !lgc_busy) { lgc_collect(lgc_step); }
+  lval* v = lmem_alloc(sizeof(lval));
+  v->type = type;
+  v->refs = 1;
+  lgc_live++;
+  lmem_count_new(type, sizeof(lval));
+  return v;
+}
+
 /* Construct a pointer to a new Number lval */
 lval* lval_num(long x) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_NUM;
+	/* Small enough to be stored in the pointer, no allocation needed */
+	if (x >= LVAL_FIXNUM_MIN && x <= LVAL_FIXNUM_MAX) {
+		return (lval*)(((uintptr_t)x << 1) | 1);
+	}
+
+	lval* v = lval_alloc(LVAL_NUM);
 	v->num = x;
 	return v;
 }
 
 lval* lval_err(char* fmt, ...) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_ERR;
+	lval* v = lval_alloc(LVAL_ERR);
 
 	/* Create a va list and initialize it */
 	va_list va;
 	va_start(va, fmt);
 
-	/* Allocate 512 bytes of space */
-	v->err = malloc(512);
-
-	/* printf the error string with a maximum of 511 characters */
-	vsnprintf(v->err, 511, fmt, va);
-
-	/* Reallocate to number of bytes actually used */
-	v->err = realloc(v->err, strlen(v->err)+1);
+	/* Format into a buffer on the stack, then allocate the message at its */
+	/* own size, formatting again only if it did not fit */
+	char small[256];
+	va_list again;
+	va_copy(again, va);
+	int n = vsnprintf(small, sizeof(small), fmt, va);
+	v->err = malloc(n + 1);
+	if (n < (int)sizeof(small)) {
+		memcpy(v->err, small, n + 1);
+	} else {
+		vsnprintf(v->err, n + 1, fmt, again);
+	}
+	va_end(again);
+	lmem_count_bytes(LVAL_ERR, n + 1);
 
 	/* Cleanup our va list and return */
 	va_end(va);
 	return v;
 }
 
+/* Symbol Intern Table */
+/* Every symbol name is stored exactly once, so symbols can be compared by pointer. */
+/* Each thread has a table of its own, as no value is ever shared between threads. */
+static _Thread_local char** lsym_table = NULL;
+static _Thread_local unsigned long lsym_count = 0;
+static _Thread_local unsigned long lsym_cap = 0;
+
+static unsigned long lsym_hash_str(char* s, size_t n) {
+  /* FNV-1a */
+  unsigned long h = 2166136261UL;
+  while (n--) { h = (h ^ (unsigned char)*s++) * 16777619UL; }
+  return h;
+}
+
+/* Return the unique interned copy of the n characters at s, which need not */
+/* be null terminated, so the reader can intern names straight from its input */
+char* lsym_intern_n(char* s, size_t n) {
+
+  /* Grow the table when it becomes half full */
+  if (lsym_count * 2 >= lsym_cap) {
+    unsigned long ncap = lsym_cap ? lsym_cap * 2 : 256;
+    char** ntable = calloc(ncap, sizeof(char*));
+    for (unsigned long i = 0; i < lsym_cap; i++) {
+      if (!lsym_table[i]) { continue; }
+      unsigned long j = lsym_hash_str(lsym_table[i], strlen(lsym_table[i])) & (ncap-1);
+      while (ntable[j]) { j = (j+1) & (ncap-1); }
+      ntable[j] = lsym_table[i];
+    }
+    free(lsym_table);
+    lsym_table = ntable;
+    lsym_cap = ncap;
+  }
+
+  /* Probe until we find the string or an empty slot */
+  unsigned long i = lsym_hash_str(s, n) & (lsym_cap-1);
+  while (lsym_table[i]) {
+    if (strncmp(lsym_table[i], s, n) == 0 && lsym_table[i][n] == '\0') { return lsym_table[i]; }
+    i = (i+1) & (lsym_cap-1);
+  }
+
+  lsym_table[i] = malloc(n + 1);
+  memcpy(lsym_table[i], s, n);
+  lsym_table[i][n] = '\0';
+  lsym_count++;
+  return lsym_table[i];
+}
+
+/* Return the unique interned copy of the string s */
+char* lsym_intern(char* s) { return lsym_intern_n(s, strlen(s)); }
+
+void lsym_cleanup(void) {
+  for (unsigned long i = 0; i < lsym_cap; i++) { free(lsym_table[i]); }
+  free(lsym_table);
+  lsym_table = NULL;
+  lsym_count = lsym_cap = 0;
+}
+
 /* Construct a pointer to a new Symbol lval */
 lval* lval_sym(char* s) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
+  lval* v = lval_alloc(LVAL_SYM);
+  v->sym = lsym_intern(s);
+  v->slot = -1;
+  return v;
+}
+
+/* New string storage with room for cap bytes of text */
+static lchars* lchars_new(long cap) {
+  lchars* c = lmem_alloc(sizeof(lchars) + cap + 1);
+  lmem_count_new(LMEM_CHARS, sizeof(lchars) + cap + 1);
+  c->refs = 1;
+  c->used = 0;
+  c->cap = cap;
+  c->text[0] = '\0';
+  return c;
+}
+
+/* Release a reference to string storage */
+static void lchars_release(lchars* c) {
+  if (--c->refs > 0) { return; }
+  lmem_count_del(LMEM_CHARS, sizeof(lchars) + c->cap + 1);
+  lmem_free(c, sizeof(lchars) + c->cap + 1);
+}
+
+/* Construct a pointer to a new String lval of the n bytes at s. If s is */
+/* NULL the text is left for the caller to write, before it is shared. */
+lval* lval_str_len(const char* s, long n) {
+  lval* v = lval_alloc(LVAL_STR);
+  v->chars = lchars_new(n);
+  v->chars->used = n;
+  v->chars->text[n] = '\0';
+  v->str = v->chars->text;
+  v->size = n;
+  if (s) { memcpy(v->str, s, n); }
   return v;
 }
 
 /* Construct a pointer to a new String lval */
-lval* lval_str(char* s) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_STR;
-  v->str = malloc(strlen(s) + 1);
-  strcpy(v->str, s);
+lval* lval_str(char* s) { return lval_str_len(s, strlen(s)); }
+
+/* Construct a pointer to a new String lval viewing n bytes of the string */
+/* v from start, sharing its storage */
+lval* lval_str_view(lval* v, long start, long n) {
+  lval* x = lval_alloc(LVAL_STR);
+  x->chars = v->chars;
+  x->chars->refs++;
+  x->str = v->str + start;
+  x->size = n;
+  return x;
+}
+
+void lval_del(lval* v); // forward declaration
+
+/* Add the n bytes at s to the end of the string v, taking v. The text goes */
+/* after v's in place if nothing else is there, or else v is copied into */
+/* new storage with room to spare for more. */
+lval* lval_str_append(lval* v, const char* s, long n) {
+  lchars* c = v->chars;
+  char* end = v->str + v->size;
+  if (end != c->text + c->used || c->used + n > c->cap) {
+    long size = v->size + n;
+    c = lchars_new(size < 8 ? 16 : size * 2);
+    memcpy(c->text, v->str, v->size);
+    c->used = v->size;
+    end = c->text + c->used;
+  } else {
+    c->refs++;
+  }
+  memcpy(end, s, n);
+  c->used += n;
+  c->text[c->used] = '\0';
+
+  /* A string used nowhere else becomes the longer one */
+  lval* x = v;
+  if (v->refs == 1) {
+    lchars_release(v->chars);
+  } else {
+    x = lval_alloc(LVAL_STR);
+    x->size = v->size;
+    lval_del(v);
+  }
+  x->str = end - x->size;
+  x->size += n;
+  x->chars = c;
+  return x;
+}
+
+/* The text of the string v with a NUL after it, for passing to C. A */
+/* string whose text is followed by more is given storage of its own. */
+char* lval_str_cstr(lval* v) {
+  if (v->str[v->size] == '\0') { return v->str; }
+  lchars* c = lchars_new(v->size);
+  memcpy(c->text, v->str, v->size);
+  c->used = v->size;
+  c->text[c->used] = '\0';
+  lchars_release(v->chars);
+  v->chars = c;
+  v->str = c->text;
+  return v->str;
+}
+
+/* Most elements a vector can hold without its size in bytes overflowing */
+#define LVEC_MAX ((long)(PTRDIFF_MAX / sizeof(int64_t)))
+
+/* Construct a pointer to a new Vector lval with room for len elements, */
+/* or NULL if there is no memory for them */
+lval* lval_vec(long len) {
+  int64_t* data = malloc(sizeof(int64_t) * (len ? len : 1));
+  if (!data) { return NULL; }
+  lval* v = lval_alloc(LVAL_VEC);
+  v->data = data;
+  v->len = len;
+  lmem_count_bytes(LVAL_VEC, lval_owned_bytes(v));
   return v;
 }
 
 lval* lval_builtin(lbuiltin func) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  lval* v = lval_alloc(LVAL_FUN);
   v->builtin = func;
+  v->formals = NULL;
+  v->name = NULL;
   return v;
 }
 
 lenv* lenv_new(void); // forward declaration
+void lval_resolve(lval* formals, lval* body); // forward declaration
+
+lval* lval_mut(lval* v); // forward declaration
 
 lval* lval_lambda(lval* formals, lval* body) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  lval* v = lval_alloc(LVAL_FUN);
 
   /* Set Builtin to NULL */
   v->builtin = NULL;
+  v->name = NULL;
 
   /* Build new environment */
   v->env = lenv_new();
 
-  /* Set Formals and Body */
-  v->formals = formals;
+  /* Set Formals and Body, resolving the formals to frame slots */
+  v->formals = lval_mut(formals);
   v->body = body;
+  lval_resolve(v->formals, body);
   return v;
 }
 
 /* A pointer to a new empty Sexpr lval */
 lval* lval_sexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SEXPR;
+  lval* v = lval_alloc(LVAL_SEXPR);
   v->count = 0;
   v->cell = NULL;
+  v->code = NULL;
+  v->cells = NULL;
   return v;
 }
 
 /* A pointer to a new empty Qexpr lval */
 lval* lval_qexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_QEXPR;
+  lval* v = lval_alloc(LVAL_QEXPR);
   v->count = 0;
   v->cell = NULL;
+  v->code = NULL;
+  v->cells = NULL;
   return v;
 }
 
 void lenv_del(lenv* e); // forward declaration
 
-/* Delete an lval and all its contents */
+/* Release a reference to an lval, queueing it to be deleted with the last one */
 void lval_del(lval* v) {
+  if (lval_is_fixnum(v) || --v->refs > 0) { return; }
+
+  if (lgc_dead_count == lgc_dead_cap) {
+    lgc_dead_cap = lgc_dead_cap ? lgc_dead_cap * 2 : 256;
+    lgc_dead = realloc(lgc_dead, sizeof(lval*) * lgc_dead_cap);
+  }
+  lgc_dead[lgc_dead_count++] = v;
+
+  /* Too much garbage queued up, reclaim all of it now */
+  if (lgc_dead_count > lgc_threshold && !lgc_busy) { lgc_collect(-1); }
+}
+
+lval* lval_copy(lval* v); // forward declaration
+
+/* New storage for cap elements, none of them used yet */
+static lcells* lcells_new(int cap) {
+  lcells* c = lmem_alloc(sizeof(lcells) + sizeof(lval*) * cap);
+  lmem_count_new(LMEM_CELLS, sizeof(lcells) + sizeof(lval*) * cap);
+  c->refs = 1;
+  c->used = 0;
+  c->cap = cap;
+  return c;
+}
+
+/* Release a reference to list storage, and the elements with the last one */
+static void lcells_release(lcells* c) {
+  if (!c || --c->refs > 0) { return; }
+  for (int i = 0; i < c->used; i++) { lval_del(c->items[i]); }
+  lmem_count_del(LMEM_CELLS, sizeof(lcells) + sizeof(lval*) * c->cap);
+  lmem_free(c, sizeof(lcells) + sizeof(lval*) * c->cap);
+}
+
+/* Slow path of lval_cells_reserve */
+static void lval_cells_grow(lval* v, int front, int back) {
+  lcells* c = v->cells;
+  int unique = c && c->refs == 1;
+  if (unique) {
+    /* Elements past the view were added by lists since deleted */
+    while (c->items + c->used > v->cell + v->count) { lval_del(c->items[--c->used]); }
+    if (v->cell - c->items >= front && c->used + back <= c->cap) { return; }
+  }
+
+  /* Grow geometrically, keeping any spare room on the side being added to */
+  int cap = v->count + front + back;
+  if (cap < v->count * 2) { cap = v->count * 2; }
+  if (cap < 4) { cap = 4; }
+  lcells* n = lcells_new(cap);
+  int start = front ? cap - v->count - back : 0;
+
+  /* Unused room before the view holds numbers, as they need no releasing */
+  for (int i = 0; i < start; i++) { n->items[i] = lval_num(0); }
+
+  /* Move the elements if nothing else can see them, otherwise share them */
+  if (unique) {
+    memcpy(n->items + start, v->cell, sizeof(lval*) * v->count);
+    c->used = v->cell - c->items;
+  } else {
+    for (int i = 0; i < v->count; i++) { n->items[start+i] = lval_copy(v->cell[i]); }
+  }
+  lcells_release(c);
+
+  n->used = start + v->count;
+  v->cells = n;
+  v->cell = n->items + start;
+}
+
+/* Give the list v storage of its own with room for front more elements */
+/* before its view and back more after it. v itself must not be shared. */
+static inline void lval_cells_reserve(lval* v, int front, int back) {
+  lcells* c = v->cells;
+  if (c && c->refs == 1 && v->cell + v->count == c->items + c->used
+      && v->cell - c->items >= front && c->used + back <= c->cap) { return; }
+  lval_cells_grow(v, front, back);
+}
+
+void lcode_del(lcode* c); // forward declaration
+void lmemo_release(lmemo* m); // forward declaration
+static void lmap_release(lmap* m); // forward declaration
+
+/* Delete a dead lval and its contents, releasing its references to others */
+static void lval_reclaim(lval* v) {
+  lmem_count_del(v->type, sizeof(lval) + lval_owned_bytes(v));
 
   switch (v->type) {
     case LVAL_NUM: break;
     case LVAL_FUN:
-      if (!v->builtin) {
+      if (lval_is_memo(v)) {
+        lmemo_release(v->memo);
+      } else if (!v->builtin) {
         lenv_del(v->env);
         lval_del(v->formals);
         lval_del(v->body);
       }
       break;
     case LVAL_ERR: free(v->err); break;
-    case LVAL_SYM: free(v->sym); break;
-    case LVAL_STR: free(v->str); break;
+    case LVAL_SYM: break; // symbol names are owned by the intern table
+    case LVAL_STR: lchars_release(v->chars); break;
+    case LVAL_VEC: free(v->data); break;
+    case LVAL_MAP: lmap_release(v->map); break;
 
-    /* If Qexpr or Sexpr then delete all elements inside */
+    /* If Qexpr or Sexpr then release the storage holding the elements */
     case LVAL_QEXPR:
     case LVAL_SEXPR:
-      for (int i = 0; i < v->count; i++) {
-        lval_del(v->cell[i]); // recursively delete each contained lval
-      }
-      /* Also free the memory allocated to contain the pointers */
-      free(v->cell);
+      lcells_release(v->cells);
+      if (v->code) { lcode_del(v->code); }
     break;
   }
 
   /* Free the memory allocated for the "lval" struct itself */
-  free(v);
+  lmem_free(v, sizeof(lval));
+  lgc_live--;
+  lgc_reclaimed++;
+}
+
+/* Reclaim up to limit queued values, or all of them (and any they release) if limit < 0 */
+static void lgc_collect(long limit) {
+  lgc_busy = 1;
+  double start = limit < 0 ? lgc_now_us() : 0;
+
+  while (lgc_dead_count && limit--) {
+    lval_reclaim(lgc_dead[--lgc_dead_count]);
+  }
+
+  /* Only full collections stop the program long enough to be worth timing */
+  if (start) {
+    double pause = lgc_now_us() - start;
+    lgc_collections++;
+    lgc_pause_total += pause;
+    if (pause > lgc_pause_max) { lgc_pause_max = pause; }
+  }
+  lgc_busy = 0;
+}
+
+void lgc_cleanup(void) {
+  lgc_collect(-1);
+  free(lgc_dead);
+  lgc_dead = NULL;
+  lgc_dead_cap = 0;
+}
+
+/* Free everything the calling thread allocated, once it holds no values, */
+/* as a thread that ran an interpreter does before it exits */
+void lprint_cleanup(void); // forward declaration
+
+void lthread_cleanup(void) {
+  lprint_cleanup();
+  lgc_cleanup();
+  lsym_cleanup();
+  lmem_cleanup();
 }
 
 lenv* lenv_copy(lenv* e); // forward declaration
+lmemo* lmemo_copy(lmemo* m); // forward declaration
 
+/* Copy an lval. Values are immutable while shared, so this only takes a reference */
 lval* lval_copy(lval* v) {
-  lval* x = malloc(sizeof(lval));
-  x->type = v->type;
+  if (!lval_is_fixnum(v)) { v->refs++; }
+  return v;
+}
+
+/* Make a new lval with the same contents, sharing the children of v */
+lval* lval_dup(lval* v) {
+  /* Vectors copy their elements, which there may be no memory for */
+  if (v->type == LVAL_VEC) {
+    lval* x = lval_vec(v->len);
+    if (!x) { return lval_err("Could not get memory to copy a vector of %li elements. D'oh!", v->len); }
+    memcpy(x->data, v->data, sizeof(int64_t) * v->len);
+    return x;
+  }
+
+  lval* x = lval_alloc(v->type);
 
   switch (v->type) {
 
-    /* Copy Functions and Numbers Directly */
+    /* Functions share formals and body, but get their own environment. */
+    /* Memoized functions share their cache. */
     case LVAL_FUN:
-      if (v->builtin) {
+      x->name = v->name;
+      if (lval_is_memo(v)) {
+        x->builtin = NULL;
+        x->formals = NULL;
+        x->memo = lmemo_copy(v->memo);
+      } else if (v->builtin) {
         x->builtin = v->builtin;
+        x->formals = NULL;
       } else {
         x->builtin = NULL;
         x->env = lenv_copy(v->env);
@@ -211,145 +878,588 @@ lval* lval_copy(lval* v) {
     case LVAL_ERR:
       x->err = malloc(strlen(v->err) + 1);
       strcpy(x->err, v->err); break;
-    case LVAL_SYM:
-      x->sym = malloc(strlen(v->sym) + 1);
-      strcpy(x->sym, v->sym); break;
+    case LVAL_SYM: x->sym = v->sym; x->slot = v->slot; break;
+
+    /* Strings share their storage, as lists do */
     case LVAL_STR:
-      x->str = malloc(strlen(v->str) + 1);
-      strcpy(x->str, v->str); break;
+      x->str = v->str;
+      x->size = v->size;
+      x->chars = v->chars;
+      x->chars->refs++;
+      break;
+    /* Maps share their storage too */
+    case LVAL_MAP:
+      x->map = v->map;
+      x->upto = v->upto;
+      x->keys = v->keys;
+      x->map->refs++;
+      break;
 
-    /* Copy Lists by copying each sub-expression */
+    /* Copy Lists by sharing their storage */
     case LVAL_SEXPR:
     case LVAL_QEXPR:
       x->count = v->count;
-      x->cell = malloc(sizeof(lval*) * x->count);
-      for (int i = 0; i < x->count; i++) {
-        x->cell[i] = lval_copy(v->cell[i]);
-      }
+      x->code = NULL;
+      x->cell = v->cell;
+      x->cells = v->cells;
+      if (x->cells) { x->cells->refs++; }
       break;
   }
 
+  lmem_count_bytes(x->type, lval_owned_bytes(x));
   return x;
 }
 
-/* Add an lval* to a Sexpr or Qexpr */
+/* Maps */
+int lval_eq(lval* x, lval* y); // forward declaration
+unsigned long lval_hash(lval* v); // forward declaration
+
+/* New map storage with room for cap entries, and an index at most half full */
+static lmap* lmap_new(int cap) {
+  int slots = 16;
+  while (slots < cap * 2) { slots *= 2; }
+  size_t size = sizeof(lmap) + sizeof(lmap_entry) * cap + sizeof(int) * slots;
+  lmap* m = lmem_alloc(size);
+  lmem_count_new(LMEM_TABLE, size);
+  m->refs = 1;
+  m->used = 0;
+  m->cap = cap;
+  m->mask = slots - 1;
+  m->slots = (int*)(m->entries + cap);
+  memset(m->slots, -1, sizeof(int) * slots);
+  return m;
+}
+
+/* Release a reference to map storage, and the keys and values with the last one */
+static void lmap_release(lmap* m) {
+  if (--m->refs > 0) { return; }
+  for (int i = 0; i < m->used; i++) {
+    lval_del(m->entries[i].key);
+    if (m->entries[i].val) { lval_del(m->entries[i].val); }
+  }
+  size_t size = sizeof(lmap) + sizeof(lmap_entry) * m->cap + sizeof(int) * (m->mask + 1);
+  lmem_count_del(LMEM_TABLE, size);
+  lmem_free(m, size);
+}
+
+/* The index slot for the key k with hash h, or the empty one it would go in */
+static int lmap_slot(lmap* m, lval* k, unsigned long h) {
+  int i = h & m->mask;
+  while (m->slots[i] != -1) {
+    lmap_entry* x = &m->entries[m->slots[i]];
+    if (x->hash == h && lval_eq(x->key, k)) { return i; }
+    i = (i + 1) & m->mask;
+  }
+  return i;
+}
+
+/* The entry holding the value of the key k in the map v, or -1 if it has none */
+int lmap_find(lval* v, lval* k) {
+  lmap* m = v->map;
+  int i = m->slots[lmap_slot(m, k, lval_hash(k))];
+  while (i >= v->upto) { i = m->entries[i].prev; }
+  return i >= 0 && m->entries[i].val ? i : -1;
+}
+
+/* True if entry i holds a value of the map v, rather than one since replaced */
+static inline int lmap_live(lval* v, int i) {
+  lmap_entry* x = &v->map->entries[i];
+  return x->val && (x->next == -1 || x->next >= v->upto);
+}
+
+/* Add an entry to the end of m, which must have room for it */
+static void lmap_add(lmap* m, lval* k, lval* x, unsigned long h) {
+  int s = lmap_slot(m, k, h);
+  int i = m->used++;
+  m->entries[i] = (lmap_entry){ k, x, h, m->slots[s], -1 };
+  if (m->slots[s] != -1) { m->entries[m->slots[s]].next = i; }
+  m->slots[s] = i;
+}
+
+/* Construct a pointer to a new empty Map lval */
+lval* lval_map(void) {
+  lval* v = lval_alloc(LVAL_MAP);
+  v->map = lmap_new(8);
+  v->upto = 0;
+  v->keys = 0;
+  return v;
+}
+
+/* Give the map v the value x for the key k, or delete k if x is NULL, taking */
+/* all three. The entry goes after v's in place if nothing else is there, or */
+/* else v's live entries are copied into new storage with room to spare. */
+lval* lval_map_set(lval* v, lval* k, lval* x) {
+  int had = lmap_find(v, k) >= 0;
+  if (!x && !had) { lval_del(k); return v; }
+
+  lmap* m = v->map;
+  if (v->upto != m->used || m->used == m->cap) {
+    m = lmap_new(v->keys < 4 ? 8 : v->keys * 2);
+    for (int i = 0; i < v->upto; i++) {
+      if (!lmap_live(v, i)) { continue; }
+      lmap_entry* y = &v->map->entries[i];
+      lmap_add(m, lval_copy(y->key), lval_copy(y->val), y->hash);
+    }
+  } else {
+    m->refs++;
+  }
+  lmap_add(m, k, x, lval_hash(k));
+
+  /* A map used nowhere else becomes the new one */
+  int keys = v->keys + (x ? !had : -1);
+  lval* r = v;
+  if (v->refs == 1) {
+    lmap_release(v->map);
+  } else {
+    r = lval_alloc(LVAL_MAP);
+    lval_del(v);
+  }
+  r->map = m;
+  r->upto = m->used;
+  r->keys = keys;
+  return r;
+}
+
+/* True if v is a list that is the only user of its storage */
+static int lval_owns_cells(lval* v) {
+  return v->refs == 1 && (!v->cells || v->cells->refs == 1);
+}
+
+/* Get a version of v that is safe to modify in place, copying it if it is shared */
+lval* lval_mut(lval* v) {
+  if (lval_is_fixnum(v)) { return v; }
+  if (v->refs > 1) {
+    lval* x = lval_dup(v);
+    lval_del(v);
+    v = x;
+  }
+
+  if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+    /* Any bytecode would no longer match the list once it is modified */
+    if (v->code) {
+      lcode_del(v->code);
+      v->code = NULL;
+    }
+    /* The elements must not be visible through any other list either */
+    if (v->cells && v->cells->refs > 1) { lval_cells_reserve(v, 0, 0); }
+  }
+  return v;
+}
+
+/* Add an lval* to a Sexpr or Qexpr, which must not be shared */
 lval* lval_add(lval* v, lval* x) {
-  v->count++;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);  // resize the memory block to hold one more lval*
+  lval_cells_reserve(v, 0, 1);
 
-  /* Add the new lval* to the end of thre array*/
-  v->cell[v->count-1] = x;
+  /* Add the new lval* to the end of the array */
+  v->cell[v->count++] = x;
+  v->cells->used++;
   return v;
 }
 
-/* Pop an element from the list at index i and return it */
+/* Pop an element from the list at index i and return it, v must not be shared */
 lval* lval_pop(lval* v, int i) {
+  lval_cells_reserve(v, 0, 0);
   lval* x = v->cell[i];
 
-  /* Shift memory after the item at "i" over the top */
-  memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
+  if (i == 0) {
+    /* Popping the head just moves the start of the view */
+    v->cell[0] = lval_num(0);
+    v->cell++;
+  } else {
+    /* Shift memory after the item at "i" over the top */
+    memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
+    v->cells->used--;
+  }
 
   /* Decrease the count of items in the list, reflecting the removal */
   v->count--;
-
-  /* Reallocate the memory used */
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
   return x;
 }
 
+/* Drop the first n elements of the list v without copying the rest, which */
+/* is still shared with any list it came from */
+lval* lval_drop(lval* v, int n) {
+  if (v->refs > 1) {
+    lval* x = lval_dup(v);
+    lval_del(v);
+    v = x;
+  } else if (v->code) {
+    lcode_del(v->code);
+    v->code = NULL;
+  }
+
+  /* Elements nothing else can see are released now */
+  if (v->cells && v->cells->refs == 1) {
+    for (int i = 0; i < n; i++) {
+      lval_del(v->cell[i]);
+      v->cell[i] = lval_num(0);
+    }
+  }
+
+  v->cell += n;
+  v->count -= n;
+  return v;
+}
+
+/* Keep only the first n elements of the list v, still sharing its storage */
+lval* lval_trunc(lval* v, int n) {
+  if (v->refs > 1) {
+    lval* x = lval_dup(v);
+    lval_del(v);
+    v = x;
+  } else if (v->code) {
+    lcode_del(v->code);
+    v->code = NULL;
+  }
+
+  /* Elements past the end of the only view of the storage are released now */
+  lcells* c = v->cells;
+  if (c && c->refs == 1 && v->cell + v->count == c->items + c->used) {
+    for (int i = n; i < v->count; i++) { lval_del(v->cell[i]); }
+    c->used -= v->count - n;
+  }
+
+  v->count = n;
+  return v;
+}
+
+/* True if no element of the list v can refer to a list */
+static int lval_is_flat(lval* v) {
+  for (int i = 0; i < v->count; i++) {
+    int t = lval_type(v->cell[i]);
+    if (t == LVAL_FUN || t == LVAL_SEXPR || t == LVAL_QEXPR) { return 0; }
+  }
+  return 1;
+}
+
 /* Join two lval lists */
 lval* lval_join(lval* x, lval* y) {
 
-  while (y->count) {
-    x = lval_add(x, lval_pop(y, 0));
+  /* Prepending a short list to a longer one nothing else uses, as in */
+  /* (join (list a) rest), only needs room at the front of the longer one */
+  if (x->count < y->count && lval_owns_cells(y)) {
+    y = lval_mut(y);
+    lval_retype(y, lval_type(x));
+    lval_cells_reserve(y, x->count, 0);
+    for (int i = x->count - 1; i >= 0; i--) {
+      y->cell--;
+      lval_del(y->cell[0]);
+      y->cell[0] = lval_copy(x->cell[i]);
+      y->count++;
+    }
+    lval_del(x);
+    return y;
+  }
+
+  /* Appending to a list whose view ends at the end of its storage, as in */
+  /* (join acc (list a)), can use the room after it even while it is shared. */
+  /* Only elements that hold no lists are added this way, as the storage */
+  /* could otherwise end up holding a reference to itself. */
+  lcells* c = x->cells;
+  if (!c || x->cell + x->count != c->items + c->used || c->used + y->count > c->cap
+      || (!lval_owns_cells(x) && !lval_is_flat(y))) {
+    x = lval_mut(x);
+    lval_cells_reserve(x, 0, y->count);
+    c = x->cells;
+  } else if (x->refs > 1) {
+    lval* n = lval_dup(x);
+    lval_del(x);
+    x = n;
+  } else if (x->code) {
+    lcode_del(x->code);
+    x->code = NULL;
   }
 
+  for (int i = 0; i < y->count; i++) {
+    x->cell[x->count++] = lval_copy(y->cell[i]);
+  }
+  c->used += y->count;
+
   lval_del(y);
   return x;
 }
 
 /* Take an lval at index i from v and delete v */
 lval* lval_take(lval* v, int i) {
-  lval* x = lval_pop(v, i);
+  lval* x;
+  if (lval_owns_cells(v)) {
+    /* Move it out, leaving a number in its place as that needs no releasing */
+    x = v->cell[i];
+    v->cell[i] = lval_num(0);
+  } else {
+    x = lval_copy(v->cell[i]);
+  }
   lval_del(v);
   return x;
 }
 
-/* Forward declaration of lval_print function */
-void lval_print(lval* v);
-
-void lval_expr_print(lval* v, char open, char close) {
-  putchar(open);
-  for (int i = 0; i < v->count; i++) {
+/* Printing */
+/* Values are written into a buffer and handed to stdio in large pieces, */
+/* rather than a character at a time. Lists are walked with an explicit */
+/* stack, so printing never recurses however deeply a value is nested. A */
+/* buffer with no file just grows, which is how a value is printed to a */
+/* string. */
+#define LBUF_SIZE 65536
+
+typedef struct {
+  char* data;
+  size_t len;
+  size_t cap;
+  FILE* out;
+} lbuf;
+
+/* Write out what the buffer holds, if it has a file */
+static void lbuf_flush(lbuf* b) {
+  if (b->out && b->len) { fwrite(b->data, 1, b->len, b->out); }
+  if (b->out) { b->len = 0; }
+}
 
-    /* Print Value contained within */
-    lval_print(v->cell[i]);
+/* Make room for n more bytes, writing out what is held first if that will do */
+static void lbuf_reserve(lbuf* b, size_t n) {
+  if (b->len + n <= b->cap) { return; }
+  lbuf_flush(b);
+  if (b->len + n <= b->cap) { return; }
+  size_t cap = b->cap ? b->cap : 256;
+  while (cap < b->len + n) { cap *= 2; }
+  b->data = realloc(b->data, cap);
+  b->cap = cap;
+}
 
-    /* Don't print trailing space if last element */
-    if (i != (v->count-1)) {
-      putchar(' ');
-    }
-  }
-  putchar(close);
+static inline void lbuf_putc(lbuf* b, char c) {
+  if (b->len == b->cap) { lbuf_reserve(b, 1); }
+  b->data[b->len++] = c;
 }
 
-void lval_print_str(lval* v) {
+static void lbuf_write(lbuf* b, const char* s, size_t n) {
+  lbuf_reserve(b, n);
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+}
 
-  /* Make a copy of the string */
-  char* escaped = malloc(strlen(v->str) + 1);
-  strcpy(escaped, v->str);
+static void lbuf_puts(lbuf* b, const char* s) { lbuf_write(b, s, strlen(s)); }
 
-  /* Pass it through the escape function */
-  escaped = mpcf_escape(escaped);
+static void lbuf_int(lbuf* b, int64_t n) {
+  char tmp[24];
+  char* p = tmp + sizeof(tmp);
+  uint64_t u = n < 0 ? -(uint64_t)n : (uint64_t)n;
+  do { *--p = '0' + u % 10; u /= 10; } while (u);
+  if (n < 0) { *--p = '-'; }
+  lbuf_write(b, p, tmp + sizeof(tmp) - p);
+}
 
-  /* Print it between " characters */
-  printf("\"%s\"", escaped);
+/* The letter after the backslash for each character the reader needs escaped */
+static const char lbuf_escapes[256] = {
+  ['\a'] = 'a', ['\b'] = 'b', ['\f'] = 'f', ['\n'] = 'n', ['\r'] = 'r',
+  ['\t'] = 't', ['\v'] = 'v', ['\\'] = '\\', ['\''] = '\'', ['"'] = '"',
+  ['\0'] = '0',
+};
 
-  /* Free the copied string */
-  free(escaped);
+/* Write the n bytes at s between " characters, escaping them as the reader */
+/* expects. Runs with nothing to escape are copied straight from the string. */
+static void lbuf_str(lbuf* b, const char* s, long n) {
+  lbuf_putc(b, '"');
+  const char* run = s;
+  const char* end = s + n;
+  for (; s < end; s++) {
+    char e = lbuf_escapes[(unsigned char)*s];
+    if (!e) { continue; }
+    lbuf_write(b, run, s - run);
+    lbuf_putc(b, '\\');
+    lbuf_putc(b, e);
+    run = s + 1;
+  }
+  lbuf_write(b, run, s - run);
+  lbuf_putc(b, '"');
 }
 
-/* Print according to type */
-void lval_print(lval* v) {
-  switch (v->type) {
+/* Write a value that holds no others, returning 0 if v is not one */
+static int lbuf_atom(lbuf* b, lval* v) {
+  switch (lval_type(v)) {
+    case LVAL_NUM: lbuf_int(b, lval_to_num(v)); return 1;
+    case LVAL_ERR: lbuf_puts(b, "Error: "); lbuf_puts(b, v->err); return 1;
+    case LVAL_SYM: lbuf_puts(b, v->sym); return 1;
+    case LVAL_STR: lbuf_str(b, v->str, v->size); return 1;
+    case LVAL_VEC:
+      lbuf_putc(b, '[');
+      for (long i = 0; i < v->len; i++) {
+        if (i) { lbuf_putc(b, ' '); }
+        lbuf_int(b, v->data[i]);
+      }
+      lbuf_putc(b, ']');
+      return 1;
     case LVAL_FUN:
-      if (v->builtin) {
-        printf("<builtin>");
+      if (!v->builtin || lval_is_memo(v)) { return 0; }
+      lbuf_puts(b, "<builtin>");
+      return 1;
+  }
+  return 0;
+}
+
+/* What is left to print: a list part way through, a value, or some text */
+typedef struct {
+  lval* v;
+  int next;
+  const char* text;
+} lprint_frame;
+
+static _Thread_local lprint_frame* lprint_stack;
+static _Thread_local int lprint_cap;
+static _Thread_local lbuf lprint_out;
+
+static void lprint_push(int* sp, lval* v, int next, const char* text) {
+  if (*sp == lprint_cap) {
+    lprint_cap = lprint_cap ? lprint_cap * 2 : 64;
+    lprint_stack = realloc(lprint_stack, sizeof(lprint_frame) * lprint_cap);
+  }
+  lprint_stack[(*sp)++] = (lprint_frame){ v, next, text };
+}
+
+lval* lmemo_fn(lmemo* m); // forward declaration
+
+/* Write a value to the buffer */
+void lbuf_val(lbuf* b, lval* v) {
+  int sp = 0;
+  lprint_push(&sp, v, -1, NULL);
+  while (sp) {
+    lprint_frame f = lprint_stack[--sp];
+    if (f.text) { lbuf_puts(b, f.text); continue; }
+
+    /* A value on its own: functions are written as their parts, in the */
+    /* reverse order they are pushed, and lists and maps are opened */
+    if (f.next < 0) {
+      if (lbuf_atom(b, f.v)) { continue; }
+      if (lval_type(f.v) == LVAL_FUN) {
+        if (lval_is_memo(f.v)) {
+          lbuf_puts(b, "(memo ");
+          lprint_push(&sp, NULL, 0, ")");
+          lprint_push(&sp, lmemo_fn(f.v->memo), -1, NULL);
+        } else {
+          lbuf_puts(b, "(\\ ");
+          lprint_push(&sp, NULL, 0, ")");
+          lprint_push(&sp, f.v->body, -1, NULL);
+          lprint_push(&sp, NULL, 0, " ");
+          lprint_push(&sp, f.v->formals, -1, NULL);
+        }
+        continue;
+      }
+      if (f.v->type == LVAL_MAP) {
+        lbuf_puts(b, "(dict");
       } else {
-        printf("(\\ "); lval_print(v->formals);
-        putchar(' '); lval_print(v->body); putchar(')');
+        lbuf_putc(b, f.v->type == LVAL_SEXPR ? '(' : '{');
       }
-      break;
-    case LVAL_NUM:   printf("%li", v->num); break;
-    case LVAL_ERR:   printf("Error: %s", v->err); break;
-    case LVAL_SYM:   printf("%s", v->sym); break;
-    case LVAL_STR:   lval_print_str(v); break;
-    case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
-    case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
+      f.next = 0;
+    }
+
+    /* Write the keys and values of a map as dict takes them, with symbol */
+    /* keys quoted, so the map reads back as it was */
+    if (f.v->type == LVAL_MAP) {
+      lval* m = f.v;
+      int nested = 0;
+      while (f.next < m->upto) {
+        int i = f.next++;
+        if (!lmap_live(m, i)) { continue; }
+        lval* k = m->map->entries[i].key;
+        int quote = lval_type(k) == LVAL_SYM;
+        lbuf_puts(b, quote ? " {" : " ");
+        lbuf_atom(b, k);
+        lbuf_puts(b, quote ? "} " : " ");
+        if (!lbuf_atom(b, m->map->entries[i].val)) {
+          lprint_push(&sp, m, f.next, NULL);
+          lprint_push(&sp, m->map->entries[i].val, -1, NULL);
+          nested = 1;
+          break;
+        }
+      }
+      if (!nested) { lbuf_puts(b, m->keys ? ")" : " ())"); }
+      continue;
+    }
+
+    /* Write elements of the list until one holding others, which is */
+    /* printed before coming back for the rest */
+    lval* l = f.v;
+    int nested = 0;
+    while (f.next < l->count) {
+      lval* x = l->cell[f.next];
+      if (f.next++) { lbuf_putc(b, ' '); }
+      if (!lbuf_atom(b, x)) {
+        lprint_push(&sp, l, f.next, NULL);
+        lprint_push(&sp, x, -1, NULL);
+        nested = 1;
+        break;
+      }
+    }
+    if (!nested) { lbuf_putc(b, l->type == LVAL_SEXPR ? ')' : '}'); }
+  }
+}
+
+/* The buffer for standard output, written out at the end of each print so */
+/* it keeps its place among anything else written there */
+static lbuf* lprint_stdout(void) {
+  if (!lprint_out.data) {
+    lprint_out.data = malloc(LBUF_SIZE);
+    lprint_out.cap = LBUF_SIZE;
+    lprint_out.out = stdout;
   }
+  return &lprint_out;
+}
+
+void lprint_cleanup(void) {
+  free(lprint_out.data);
+  free(lprint_stack);
+  lprint_out = (lbuf){0};
+  lprint_stack = NULL;
+  lprint_cap = 0;
+}
+
+/* Print a value */
+void lval_print(lval* v) {
+  lbuf* b = lprint_stdout();
+  lbuf_val(b, v);
+  lbuf_flush(b);
 }
 
 /* Print an lval followed by a newline */
-void lval_println(lval* v) { lval_print(v); putchar('\n'); }
+void lval_println(lval* v) {
+  lbuf* b = lprint_stdout();
+  lbuf_val(b, v);
+  lbuf_putc(b, '\n');
+  lbuf_flush(b);
+}
+
+/* Print a value into a new string, as print would write it */
+lval* lval_show(lval* v) {
+  lbuf b = {0};
+  lbuf_val(&b, v);
+  lval* s = lval_str_len(b.data, b.len);
+  free(b.data);
+  return s;
+}
 
 int lval_eq(lval* x, lval* y) {
 
   /* Different Types are always unequal */
-  if (x->type != y->type) { return 0; }
+  if (lval_type(x) != lval_type(y)) { return 0; }
 
   /* Compare based upon Type */
-  switch (x->type) {
+  switch (lval_type(x)) {
 
     /* Compare Number Value */
-    case LVAL_NUM: return (x->num == y->num);
+    case LVAL_NUM: return (lval_to_num(x) == lval_to_num(y));
 
     /* Compare String Values */
     case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
-    case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
-    case LVAL_STR: return (strcmp(x->str, y->str) == 0);
+    case LVAL_SYM: return (x->sym == y->sym);
+    case LVAL_STR: return x->size == y->size && memcmp(x->str, y->str, x->size) == 0;
+
+    /* Compare Vector elements */
+    case LVAL_VEC:
+      return x->len == y->len && memcmp(x->data, y->data, sizeof(int64_t) * x->len) == 0;
 
-    /* If builtin compare, otherwise compare formals and body */
+    /* If builtin or memoized compare, otherwise compare formals and body */
     case LVAL_FUN:
+      if (lval_is_memo(x) || lval_is_memo(y)) {
+        return lval_is_memo(x) && lval_is_memo(y) && x->memo == y->memo;
+      }
       if (x->builtin || y->builtin) {
         return x->builtin == y->builtin;
       } else {
@@ -367,10 +1477,63 @@ int lval_eq(lval* x, lval* y) {
       /* Otherwise lists must be equal */
       return 1;
     break;
-  }
+
+    /* Maps are equal with the same keys and equal values, in any order */
+    case LVAL_MAP:
+      if (x->keys != y->keys) { return 0; }
+      for (int i = 0; i < x->upto; i++) {
+        if (!lmap_live(x, i)) { continue; }
+        int j = lmap_find(y, x->map->entries[i].key);
+        if (j < 0 || !lval_eq(x->map->entries[i].val, y->map->entries[j].val)) { return 0; }
+      }
+      return 1;
+  }
   return 0;
 }
 
+/* Hash of v that agrees with lval_eq, so values it finds equal hash the same */
+unsigned long lval_hash(lval* v) {
+  int t = lval_type(v);
+  unsigned long h = 0;
+
+  switch (t) {
+    case LVAL_NUM: h = lval_to_num(v); break;
+    case LVAL_ERR: h = lsym_hash_str(v->err, strlen(v->err)); break;
+    case LVAL_SYM: h = (unsigned long)v->sym; break;
+    case LVAL_STR: h = lsym_hash_str(v->str, v->size); break;
+    case LVAL_VEC: h = lsym_hash_str((char*)v->data, sizeof(int64_t) * v->len); break;
+    case LVAL_FUN:
+      if (lval_is_memo(v)) {
+        h = (unsigned long)v->memo;
+      } else if (v->builtin) {
+        h = (unsigned long)(uintptr_t)v->builtin;
+      } else {
+        h = lval_hash(v->formals) * 31 + lval_hash(v->body);
+      }
+      break;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      h = v->count;
+      for (int i = 0; i < v->count; i++) { h = h * 31 + lval_hash(v->cell[i]); }
+      break;
+
+    /* Summed, so the order of the entries makes no difference */
+    case LVAL_MAP:
+      h = v->keys;
+      for (int i = 0; i < v->upto; i++) {
+        if (!lmap_live(v, i)) { continue; }
+        h += v->map->entries[i].hash * 31 + lval_hash(v->map->entries[i].val);
+      }
+      break;
+  }
+
+  /* Mix in the type and spread the bits, as lenv_hash_sym does */
+  h ^= (unsigned long)t << 56;
+  h ^= h >> 17;
+  h *= 0x9E3779B97F4A7C15UL;
+  return h ^ (h >> 29);
+}
+
 char* ltype_name(int t) {
   switch(t) {
     case LVAL_FUN: return "Function";
@@ -380,94 +1543,204 @@ char* ltype_name(int t) {
     case LVAL_STR: return "String";
     case LVAL_SEXPR: return "S-Expression";
     case LVAL_QEXPR: return "Q-Expression";
+    case LVAL_VEC: return "Vector";
+    case LVAL_MAP: return "Map";
     default: return "Unknown";
   }
 }
 
 /* Lisp Environment */
+/* Symbols are interned so entries are matched by pointer. Small frames (such
+   as function arguments) are scanned linearly, larger ones get a hash index. */
+#define LENV_LINEAR_MAX 8
+
 struct lenv {
   lenv* par; // pointer to parent environment
   int count;
+  int cap;
   char** syms;
   lval** vals;
+
+  /* Open addressed index of slot+1 (0 is empty), NULL while frame is small */
+  int* index;
+  int index_cap;
+
+  /* One bit per symbol bound here, so lookups can skip frames that can't match */
+  unsigned long filter;
 };
 
 lenv* lenv_new(void) {
-  lenv* e = malloc(sizeof(lenv));
+  lenv* e = lmem_alloc(sizeof(lenv));
+  lmem_count_new(LMEM_ENV, sizeof(lenv));
   e->par = NULL;
+  e->filter = 0;
   e->count = 0;
+  e->cap = 0;
   e->syms = NULL;
   e->vals = NULL;
+  e->index = NULL;
+  e->index_cap = 0;
   return e;
 }
 
 void lenv_del(lenv* e) {
   for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
     lval_del(e->vals[i]);
   }
-  free(e->syms);
-  free(e->vals);
-  free(e);
+  lmem_count_del(LMEM_ENV, sizeof(lenv) + (sizeof(char*) + sizeof(lval*)) * e->cap + sizeof(int) * e->index_cap);
+  lmem_free(e->syms, sizeof(char*) * e->cap);
+  lmem_free(e->vals, sizeof(lval*) * e->cap);
+  free(e->index);
+  lmem_free(e, sizeof(lenv));
+}
+
+static unsigned long lenv_hash_sym(char* sym) {
+  /* Interned pointers are unique, so hash the address itself */
+  unsigned long h = (unsigned long)sym;
+  h ^= h >> 17;
+  h *= 0x9E3779B97F4A7C15UL;
+  return h ^ (h >> 29);
+}
+
+static unsigned long lenv_filter_bit(char* sym) {
+  return 1UL << (lenv_hash_sym(sym) >> 58);
+}
+
+/* Insert slot i into the hash index */
+static void lenv_index_add(lenv* e, int i) {
+  unsigned long j = lenv_hash_sym(e->syms[i]) & (e->index_cap-1);
+  while (e->index[j]) { j = (j+1) & (e->index_cap-1); }
+  e->index[j] = i+1;
+}
+
+/* Rebuild the hash index so it is at most half full */
+static void lenv_reindex(lenv* e) {
+  int ncap = e->index_cap ? e->index_cap : 32;
+  while (ncap < e->count * 2) { ncap *= 2; }
+  free(e->index);
+  e->index = calloc(ncap, sizeof(int));
+  lmem_count_bytes(LMEM_ENV, sizeof(int) * (ncap - e->index_cap));
+  e->index_cap = ncap;
+  for (int i = 0; i < e->count; i++) { lenv_index_add(e, i); }
+}
+
+/* Find the slot of an interned symbol in this frame only, or -1 */
+int lenv_find(lenv* e, char* sym) {
+  if (!e->index) {
+    for (int i = 0; i < e->count; i++) {
+      if (e->syms[i] == sym) { return i; }
+    }
+    return -1;
+  }
+
+  unsigned long j = lenv_hash_sym(sym) & (e->index_cap-1);
+  while (e->index[j]) {
+    if (e->syms[e->index[j]-1] == sym) { return e->index[j]-1; }
+    j = (j+1) & (e->index_cap-1);
+  }
+  return -1;
 }
 
 lenv* lenv_copy(lenv* e) {
-  lenv* n = malloc(sizeof(lenv));
+  lenv* n = lmem_alloc(sizeof(lenv));
+  lmem_count_new(LMEM_ENV, sizeof(lenv) + (sizeof(char*) + sizeof(lval*)) * e->count);
   n->par = e->par;
+  n->filter = e->filter;
   n->count = e->count;
-  n->syms = malloc(sizeof(char*) * n->count);
-  n->vals = malloc(sizeof(lval*) * n->count);
+  n->cap = e->count;
+  n->syms = lmem_alloc(sizeof(char*) * n->count);
+  n->vals = lmem_alloc(sizeof(lval*) * n->count);
   for (int i = 0; i < e->count; i++) {
-    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-    strcpy(n->syms[i], e->syms[i]);
+    n->syms[i] = e->syms[i];
     n->vals[i] = lval_copy(e->vals[i]);
   }
+  n->index = NULL;
+  n->index_cap = 0;
+  if (n->count > LENV_LINEAR_MAX) { lenv_reindex(n); }
   return n;
 }
 
+/* Add a new entry at the end of the frame, doubling the arrays as needed */
+static void lenv_append(lenv* e, char* sym, lval* v) {
+  if (e->count == e->cap) {
+    int ncap = e->cap ? e->cap * 2 : 4;
+    e->vals = lmem_realloc(e->vals, sizeof(lval*) * e->cap, sizeof(lval*) * ncap);
+    e->syms = lmem_realloc(e->syms, sizeof(char*) * e->cap, sizeof(char*) * ncap);
+    lmem_count_bytes(LMEM_ENV, (sizeof(char*) + sizeof(lval*)) * (ncap - e->cap));
+    e->cap = ncap;
+  }
+
+  e->vals[e->count] = v;
+  e->syms[e->count] = sym;
+  e->filter |= lenv_filter_bit(sym);
+  e->count++;
+
+  /* Keep the hash index in step once the frame is large */
+  if (e->index) {
+    if (e->count * 2 > e->index_cap) { lenv_reindex(e); } else { lenv_index_add(e, e->count-1); }
+  } else if (e->count > LENV_LINEAR_MAX) {
+    lenv_reindex(e);
+  }
+}
+
 lval* lenv_get(lenv* e, lval* k) {
 
-  /* Iterate over all items in environment */
-  for (int i = 0; i < e->count; i++) {
-    /* Check if the stored string matches the symbol string */
-    /* If it does, return a copy of the value */
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      return lval_copy(e->vals[i]);
-    }
+  /* Try the slot the resolver gave k first. It is only trusted if this frame still */
+  /* binds k there, in which case a search by name would have found the same entry */
+  if (k->slot >= 0 && k->slot < e->count && e->syms[k->slot] == k->sym) {
+    return lval_copy(e->vals[k->slot]);
   }
 
-  /* If no symbol found, check in parent, otherwise return an error */
-  if (e->par) {
-    return lenv_get(e->par, k);
-  } else {
-    return lval_err("Unbound Symbol '%s'", k->sym);
+  /* Walk up the chain of environments looking for the symbol, */
+  /* only searching frames whose filter says it might be there */
+  unsigned long bit = lenv_filter_bit(k->sym);
+  while (e) {
+    if (e->filter & bit) {
+      int i = lenv_find(e, k->sym);
+      /* If found, return a copy of the value */
+      if (i >= 0) { return lval_copy(e->vals[i]); }
+    }
+    e = e->par;
   }
+
+  /* If no symbol found, return an error */
+  return lval_err("Unbound Symbol '%s'", k->sym);
 }
 
 void lenv_put(lenv* e, lval* k, lval* v) {
 
-  /* Iterate over all items in environment */
-  /* This is to see if variable already exists */
-  for (int i = 0; i < e->count; i++) {
+  /* See if the variable already exists */
+  /* If so delete item at that position and replace with new value */
+  int i = lenv_find(e, k->sym);
+  if (i >= 0) {
+    lval_del(e->vals[i]);
+    e->vals[i] = lval_copy(v);
+    return;
+  }
 
-    /* If variable is found delete item at that position */
-    /* And replace with new value supplied by user */
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
-      return;
-    }
+  /* If no existing entry found then add a copy of the value */
+  lenv_append(e, k->sym, lval_copy(v));
+}
+
+/* Bind k to v by the slot the resolver gave k, taking ownership of v */
+void lenv_bind(lenv* e, lval* k, lval* v) {
+
+  /* Next free slot, as when binding a function's formals in order */
+  if (k->slot == e->count) {
+    lenv_append(e, k->sym, v);
+    return;
   }
 
-  /* If no existing entry found then allocate space for new entry */
-  e->count++;
-  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-  e->syms = realloc(e->syms, sizeof(char*) * e->count);
+  /* Slot already holds this symbol, e.g. a repeated formal */
+  if (k->slot >= 0 && k->slot < e->count && e->syms[k->slot] == k->sym) {
+    lval_del(e->vals[k->slot]);
+    e->vals[k->slot] = v;
+    return;
+  }
 
-  /* Copy contents of lval and symbol string into new location */
-  e->vals[e->count-1] = lval_copy(v);
-  e->syms[e->count-1] = malloc(strlen(k->sym) + 1);
-  strcpy(e->syms[e->count-1], k->sym);
+  /* Otherwise fall back to binding by name */
+  lenv_put(e, k, v);
+  lval_del(v);
 }
 
 void lenv_def(lenv* e, lval* k, lval* v) {
@@ -487,9 +1760,9 @@ void lenv_def(lenv* e, lval* k, lval* v) {
   }
 
 #define LASSERT_TYPE(func, args, index, expect) \
-  LASSERT(args, args->cell[index]->type == expect, \
+  LASSERT(args, lval_type(args->cell[index]) == expect, \
     "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
-    func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+    func, index, ltype_name(lval_type(args->cell[index])), ltype_name(expect))
 
 #define LASSERT_NUM(func, args, num) \
   LASSERT(args, args->count == num, \
@@ -500,8 +1773,56 @@ void lenv_def(lenv* e, lval* k, lval* v) {
   LASSERT(args, args->cell[index]->count != 0, \
     "Function '%s' passed {} for argument %i.", func, index);
 
-/* Forward declaration of lval_eval function */
+/* Forward declaration of lval_eval functions */
 lval* lval_eval(lenv* e, lval* v);
+lval* lval_eval_list(lenv* e, lval* v);
+lval* lval_eval_loop(lenv* base, lenv* e, lval* v);
+lval* lval_call(lenv* e, lval* f, lval* a);
+
+/* Lexical Addressing */
+/* A function's frame is filled in formal order, so formal i (not counting '&') */
+/* always lives in slot i. Symbols in the body naming a formal are given that */
+/* slot so binding and reading arguments is array indexing. Nested lambdas are */
+/* skipped, they are resolved against their own formals when they are built. */
+/* Frames are parented to the caller, so deeper addresses are not stable and */
+/* other symbols are still looked up by name. */
+static void lval_resolve_body(lval* formals, lval* v) {
+  if (lval_type(v) == LVAL_SYM) {
+    for (int i = 0; i < formals->count; i++) {
+      if (formals->cell[i]->sym == v->sym) { v->slot = formals->cell[i]->slot; return; }
+    }
+    return;
+  }
+
+  if (lval_type(v) != LVAL_SEXPR && lval_type(v) != LVAL_QEXPR) { return; }
+
+  /* Leave nested lambdas for when they are built */
+  if (v->count == 3 && lval_type(v->cell[0]) == LVAL_SYM && strcmp(v->cell[0]->sym, "\\") == 0) {
+    return;
+  }
+
+  for (int i = 0; i < v->count; i++) {
+    lval_resolve_body(formals, v->cell[i]);
+  }
+}
+
+void lval_resolve(lval* formals, lval* body) {
+  int slot = 0;
+  for (int i = 0; i < formals->count; i++) {
+    /* Formals carry the slot binding trusts, so they must not be shared */
+    lval* s = formals->cell[i] = lval_mut(formals->cell[i]);
+    s->slot = -1;
+    if (strcmp(s->sym, "&") == 0) { continue; }
+
+    /* A repeated formal rebinds the slot of its first occurrence */
+    for (int j = 0; j < i; j++) {
+      if (formals->cell[j]->sym == s->sym) { s->slot = formals->cell[j]->slot; break; }
+    }
+    if (s->slot == -1) { s->slot = slot++; }
+  }
+
+  lval_resolve_body(formals, body);
+}
 
 lval* builtin_lambda(lenv* e, lval* a) {
   /* Check Two Arguments, Each of which are Q-Expressions */
@@ -511,9 +1832,9 @@ lval* builtin_lambda(lenv* e, lval* a) {
 
   /* Check First Q-Expression Contains Only Symbols */
   for (int i = 0; i < a->cell[0]->count; i++) {
-    LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+    LASSERT(a, (lval_type(a->cell[0]->cell[i]) == LVAL_SYM),
       "Cannot define non-symbol. Got %s, Expected %s.",
-      ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+      ltype_name(lval_type(a->cell[0]->cell[i])), ltype_name(LVAL_SYM));
   }
 
   /* Pop first two arguments and pass them to lval_lambda */
@@ -527,7 +1848,8 @@ lval* builtin_lambda(lenv* e, lval* a) {
 
 /* List function: Converts given S-Expression to Q-Expression */
 lval* builtin_list(lenv* e, lval* a) {
-  a->type = LVAL_QEXPR;
+  a = lval_mut(a);
+  lval_retype(a, LVAL_QEXPR);
   return a;
 }
 
@@ -538,8 +1860,9 @@ lval* builtin_head(lenv* e, lval* a) {
   LASSERT_NOT_EMPTY("head", a, 0);
 
   lval* v = lval_take(a, 0); // Otherwise take first argument
-  while (v->count > 1) { lval_del(lval_pop(v, 1)); } // And delete all elements that are not head and then return
-  return v;
+  lval* x = lval_add(lval_qexpr(), lval_copy(v->cell[0])); // And return a new list of just its head
+  lval_del(v);
+  return x;
 }
 
 /* Tail function : Takes a Q-Expression and returns a Q-Expression WITHOUT the head. */
@@ -549,18 +1872,22 @@ lval* builtin_tail(lenv* e, lval* a) {
   LASSERT_NOT_EMPTY("tail", a, 0);
 
   lval* v = lval_take(a, 0); // Take the first argument
-  lval_del(lval_pop(v, 0)); // Delete the first element (head) and return
-  return v;
+  return lval_drop(v, 1); // And return a view past its head, sharing the rest
 }
 
-/* Eval function : Takes a Q-Expression, converts to an S-Expression, and evaluates it using lval_eval */
-lval* builtin_eval(lenv* e, lval* a) {
+/* Check the arguments to eval, returning the Q-Expression to evaluate */
+lval* lval_eval_arg(lval* a) {
   LASSERT_NUM("eval", a, 1);
   LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
 
-  lval* x = lval_take(a, 0);
-  x->type = LVAL_SEXPR;
-  return lval_eval(e, x);
+  return lval_take(a, 0);
+}
+
+/* Eval function : Takes a Q-Expression, converts to an S-Expression, and evaluates it using lval_eval */
+lval* builtin_eval(lenv* e, lval* a) {
+  lval* x = lval_eval_arg(a);
+  if (lval_type(x) == LVAL_ERR) { return x; }
+  return lval_eval_list(e, x);
 }
 
 /* Join function : Takes any number of Q-Expressions and joins them together into a single Q-Expression */
@@ -580,54 +1907,441 @@ lval* builtin_join(lenv* e, lval* a) {
   return x;
 }
 
-/* Handles operators */
-lval* builtin_op(lenv* e, lval* a, char* op) { // a should be a sexpr containing numbers
+/* Arithmetic */
+/* Each operator checks its arguments are numbers in one pass, then folds them */
+/* in place. Results that leave the range of a long are an error rather than */
+/* silently wrapping. */
+#define LASSERT_NUMS(func, args) \
+  for (int i = 0; i < args->count; i++) { LASSERT_TYPE(func, args, i, LVAL_NUM); }
+
+/* As LASSERT_NUMS, for operators that need a number to start from */
+#define LASSERT_SOME_NUMS(func, args) \
+  LASSERT(args, args->count > 0, \
+    "Function '%s' needs at least one argument. D'oh!", func); \
+  LASSERT_NUMS(func, args)
+
+#define LVAL_OVERFLOW(func, args) \
+  { lval_del(args); return lval_err("Function '%s' overflowed. Ah, sweet merciful numbers!", func); }
+
+/* Vector registers for the reductions below, where the compiler has them. */
+/* 16 bytes is the width every x86-64 and arm64 machine has. */
+#if defined(__GNUC__) && !defined(SNEED_NO_VECTOR)
+#define LVAL_VECTOR
+typedef uint64_t lvec __attribute__((vector_size(16)));
+#define LVEC_N (int)(sizeof(lvec) / sizeof(uint64_t))
+#endif
 
-  /* Ensure all arguments are numbers */
-  for (int i = 0; i < a->count; i++) {
-    LASSERT_TYPE(op, a, i, LVAL_NUM);
+/* Sum the n arguments in cell into out, returning 0 if any is not a fixnum */
+/* within 32 bits. Within those bounds no order of adding them can overflow, */
+/* so the raw tagged words are summed a vector at a time and the tags taken */
+/* off at the end: n fixnums 2x+1 add up to twice their total plus n. */
+static int lval_sum_small(lval** cell, int n, long* out) {
+#if UINTPTR_MAX != UINT64_MAX
+  return 0;
+#else
+  uint64_t tag = 1, big = 0, sum = 0;
+  int i = 0;
+
+#ifdef LVAL_VECTOR
+  lvec vtag = (lvec){0} + 1, vbig = {0}, vsum = {0};
+  for (; i + LVEC_N <= n; i += LVEC_N) {
+    lvec p;
+    memcpy(&p, cell + i, sizeof(p));
+    vtag &= p;
+    vbig |= (p + ((uint64_t)1 << 32)) >> 33;
+    vsum += p;
+  }
+  for (int j = 0; j < LVEC_N; j++) {
+    tag &= vtag[j]; big |= vbig[j]; sum += vsum[j];
   }
+#endif
 
-  /* Pop the first element, which we will be operating on */
-  lval* x = lval_pop(a, 0);
+  for (; i < n; i++) {
+    uint64_t p = (uintptr_t)cell[i];
+    tag &= p;
+    big |= (p + ((uint64_t)1 << 32)) >> 33;
+    sum += p;
+  }
+
+  if (!(tag & 1) || big) { return 0; }
+  *out = ((int64_t)sum - n) / 2;
+  return 1;
+#endif
+}
+
+lval* builtin_add(lenv* e, lval* a) {
+  long x;
+  if (lval_sum_small(a->cell, a->count, &x)) {
+    lval_del(a);
+    return lval_num(x);
+  }
 
-  /* If it's a sub and there are no more arguments, then negate it */
-  if ((strcmp(op, "-") == 0) && a->count == 0) {
-    x->num = -x->num;
+  LASSERT_NUMS("+", a);
+  x = lval_to_num(a->cell[0]);
+  for (int i = 1; i < a->count; i++) {
+    if (__builtin_add_overflow(x, lval_to_num(a->cell[i]), &x)) { LVAL_OVERFLOW("+", a); }
   }
+  lval_del(a);
+  return lval_num(x);
+}
 
-  /* While there are still elements remaining */
-  while (a->count > 0) {
+lval* builtin_sub(lenv* e, lval* a) {
+  long x;
+  /* x0 - (x1 + ... + xn) is 2*x0 minus the sum of them all */
+  if (a->count > 1 && lval_sum_small(a->cell, a->count, &x)) {
+    x = 2 * lval_to_num(a->cell[0]) - x;
+    lval_del(a);
+    return lval_num(x);
+  }
 
-    /* Pop the next element */
-    lval* y = lval_pop(a, 0);
+  LASSERT_SOME_NUMS("-", a);
+  x = lval_to_num(a->cell[0]);
 
-    /* Perform operation */
-    if (strcmp(op, "+") == 0) { x->num += y->num; }
-    if (strcmp(op, "-") == 0) { x->num -= y->num; }
-    if (strcmp(op, "*") == 0) { x->num *= y->num; }
-    if (strcmp(op, "/") == 0) {
-      if (y->num == 0) {
-        lval_del(x); lval_del(y);
-        x = lval_err("You can't divide by zero, that's unpossible!");
-        break;
-      }
-      x->num /= y->num;
+  /* If there are no more arguments, then negate it */
+  if (a->count == 1) {
+    if (x == LONG_MIN) { LVAL_OVERFLOW("-", a); }
+    x = -x;
+  }
+
+  for (int i = 1; i < a->count; i++) {
+    if (__builtin_sub_overflow(x, lval_to_num(a->cell[i]), &x)) { LVAL_OVERFLOW("-", a); }
+  }
+  lval_del(a);
+  return lval_num(x);
+}
+
+lval* builtin_mul(lenv* e, lval* a) {
+  LASSERT_SOME_NUMS("*", a);
+  long x = lval_to_num(a->cell[0]);
+  for (int i = 1; i < a->count; i++) {
+    if (__builtin_mul_overflow(x, lval_to_num(a->cell[i]), &x)) { LVAL_OVERFLOW("*", a); }
+  }
+  lval_del(a);
+  return lval_num(x);
+}
+
+lval* builtin_div(lenv* e, lval* a) {
+  LASSERT_SOME_NUMS("/", a);
+  long x = lval_to_num(a->cell[0]);
+  for (int i = 1; i < a->count; i++) {
+    long y = lval_to_num(a->cell[i]);
+    if (y == 0) {
+      lval_del(a);
+      return lval_err("You can't divide by zero, that's unpossible!");
+    }
+    if (x == LONG_MIN && y == -1) { LVAL_OVERFLOW("/", a); }
+    x /= y;
+  }
+  lval_del(a);
+  return lval_num(x);
+}
+
+/* Vectors */
+/* Elementwise kernels take the output, a vector x and either a vector y */
+/* (ystep 1) or a single number broadcast to every element (ystep 0), and */
+/* return nonzero if any element overflowed. out may be x itself. Additions */
+/* run a vector of lanes at a time where LVAL_VECTOR is available, then one */
+/* at a time for the rest. Baseline x86-64 has no 64 bit vector multiply or */
+/* compare, so products and min/max are left as plain loops. */
+#define LVEC_LOAD(v, p) memcpy(&(v), (p), sizeof(v))
+#define LVEC_STORE(p, v) memcpy((p), &(v), sizeof(v))
+
+/* Addition and subtraction overflow when the sign of the result is wrong, */
+/* which is marked in the top bit of OVERFLOW */
+#ifdef LVAL_VECTOR
+#define LVEC_LANES(OP, OVERFLOW) \
+  lvec vov = {0}, b = (lvec){0} + (uint64_t)y[0]; \
+  for (; i + LVEC_N <= n; i += LVEC_N) { \
+    lvec a, r; \
+    LVEC_LOAD(a, x + i); \
+    if (ystep) { LVEC_LOAD(b, y + i); } \
+    r = a OP b; \
+    vov |= OVERFLOW; \
+    LVEC_STORE(out + i, r); \
+  } \
+  for (int j = 0; j < LVEC_N; j++) { ov |= vov[j]; }
+#else
+#define LVEC_LANES(OP, OVERFLOW)
+#endif
+
+#define LVEC_ARITH(name, OP, OVERFLOW) \
+  static int name(int64_t* out, const int64_t* x, const int64_t* y, int ystep, long n) { \
+    uint64_t ov = 0; \
+    long i = 0; \
+    LVEC_LANES(OP, OVERFLOW) \
+    for (; i < n; i++) { \
+      uint64_t a = x[i], b = y[i * ystep], r = a OP b; \
+      ov |= OVERFLOW; \
+      out[i] = r; \
+    } \
+    return ov >> 63; \
+  }
+
+LVEC_ARITH(lvec_add, +, (a ^ r) & (b ^ r))
+LVEC_ARITH(lvec_sub, -, (a ^ b) & (a ^ r))
+
+static int lvec_mul(int64_t* out, const int64_t* x, const int64_t* y, int ystep, long n) {
+  int ov = 0;
+  for (long i = 0; i < n; i++) {
+    /* Into a local first, as out may be x */
+    int64_t r;
+    ov |= __builtin_mul_overflow(x[i], y[i * ystep], &r);
+    out[i] = r;
+  }
+  return ov;
+}
+
+/* Returns 2 rather than 1 for a division by zero */
+static int lvec_div(int64_t* out, const int64_t* x, const int64_t* y, int ystep, long n) {
+  for (long i = 0; i < n; i++) {
+    int64_t d = y[i * ystep];
+    if (d == 0) { return 2; }
+    if (d == -1 && x[i] == INT64_MIN) { return 1; }
+    out[i] = x[i] / d;
+  }
+  return 0;
+}
+
+/* Sum x into *out, returning nonzero on overflow. The lanes are summed */
+/* separately, so if one of them overflows the sum is redone in order to */
+/* tell whether the total really does. */
+static int lvec_sum(const int64_t* x, long n, int64_t* out) {
+  uint64_t sum = 0, ov = 0;
+  long i = 0;
+
+#ifdef LVAL_VECTOR
+  lvec vsum = {0}, vov = {0};
+  for (; i + LVEC_N <= n; i += LVEC_N) {
+    lvec a, r;
+    LVEC_LOAD(a, x + i);
+    r = vsum + a;
+    vov |= (a ^ r) & (vsum ^ r);
+    vsum = r;
+  }
+  for (int j = 0; j < LVEC_N; j++) {
+    uint64_t r = sum + vsum[j];
+    ov |= vov[j] | ((vsum[j] ^ r) & (sum ^ r));
+    sum = r;
+  }
+#endif
+
+  for (; i < n; i++) {
+    uint64_t r = sum + x[i];
+    ov |= ((uint64_t)x[i] ^ r) & (sum ^ r);
+    sum = r;
+  }
+
+  if (ov >> 63) {
+    int64_t s = 0;
+    for (i = 0; i < n; i++) {
+      if (__builtin_add_overflow(s, x[i], &s)) { return 1; }
     }
+    sum = s;
+  }
+  *out = sum;
+  return 0;
+}
+
+/* Dot product of x and y into *out, returning nonzero on overflow */
+static int lvec_dot(const int64_t* x, const int64_t* y, long n, int64_t* out) {
+  int64_t sum = 0, p;
+  for (long i = 0; i < n; i++) {
+    if (__builtin_mul_overflow(x[i], y[i], &p) || __builtin_add_overflow(sum, p, &sum)) { return 1; }
+  }
+  *out = sum;
+  return 0;
+}
+
+/* Smallest (or largest) of the n > 0 elements of x */
+#define LVEC_PICK(name, CMP) \
+  static int64_t name(const int64_t* x, long n) { \
+    int64_t r = x[0]; \
+    for (long i = 1; i < n; i++) { if (x[i] CMP r) { r = x[i]; } } \
+    return r; \
+  }
+
+LVEC_PICK(lvec_min, <)
+LVEC_PICK(lvec_max, >)
+
+/* Check that lval_vec found memory for the n elements of v */
+#define LASSERT_VEC_ALLOC(func, args, v, n) \
+  LASSERT(args, v, "Function '%s' could not get memory for %li elements. D'oh!", func, (long)(n))
+
+/* Vector from its arguments, e.g. (vec 1 2 3) */
+lval* builtin_vec(lenv* e, lval* a) {
+  LASSERT_NUMS("vec", a);
+  lval* v = lval_vec(a->count);
+  LASSERT_VEC_ALLOC("vec", a, v, a->count);
+  for (int i = 0; i < a->count; i++) { v->data[i] = lval_to_num(a->cell[i]); }
+  lval_del(a);
+  return v;
+}
+
+/* Vector of 0 up to n-1 */
+lval* builtin_vec_range(lenv* e, lval* a) {
+  LASSERT_NUM("vec-range", a, 1);
+  LASSERT_TYPE("vec-range", a, 0, LVAL_NUM);
+  long n = lval_to_num(a->cell[0]);
+  LASSERT(a, n >= 0, "Function 'vec-range' passed a negative length. Got %li.", n);
+  LASSERT(a, n <= LVEC_MAX,
+    "Function 'vec-range' passed too long a length. Got %li, Expected at most %li.", n, LVEC_MAX);
+
+  lval* v = lval_vec(n);
+  LASSERT_VEC_ALLOC("vec-range", a, v, n);
+  for (long i = 0; i < n; i++) { v->data[i] = i; }
+  lval_del(a);
+  return v;
+}
 
-    /* Delete element now finished with */
-    lval_del(y);
+lval* builtin_list_vec(lenv* e, lval* a) {
+  LASSERT_NUM("list->vec", a, 1);
+  LASSERT_TYPE("list->vec", a, 0, LVAL_QEXPR);
+  lval* q = a->cell[0];
+  for (int i = 0; i < q->count; i++) {
+    LASSERT(a, lval_type(q->cell[i]) == LVAL_NUM,
+      "Function 'list->vec' passed a list with a %s in it. Only numbers can go in a vector.",
+      ltype_name(lval_type(q->cell[i])));
   }
 
-  /* Delete input expression and return result */
+  lval* v = lval_vec(q->count);
+  LASSERT_VEC_ALLOC("list->vec", a, v, q->count);
+  for (int i = 0; i < q->count; i++) { v->data[i] = lval_to_num(q->cell[i]); }
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_vec_list(lenv* e, lval* a) {
+  LASSERT_NUM("vec->list", a, 1);
+  LASSERT_TYPE("vec->list", a, 0, LVAL_VEC);
+  lval* v = a->cell[0];
+  LASSERT(a, v->len <= INT_MAX, "Function 'vec->list' passed a vector too long for a list.");
+
+  lval* q = lval_qexpr();
+  if (v->len) { lval_cells_reserve(q, 0, v->len); }
+  for (long i = 0; i < v->len; i++) { q = lval_add(q, lval_num(v->data[i])); }
+  lval_del(a);
+  return q;
+}
+
+lval* builtin_vec_len(lenv* e, lval* a) {
+  LASSERT_NUM("vec-len", a, 1);
+  LASSERT_TYPE("vec-len", a, 0, LVAL_VEC);
+  long n = a->cell[0]->len;
+  lval_del(a);
+  return lval_num(n);
+}
+
+lval* builtin_vec_get(lenv* e, lval* a) {
+  LASSERT_NUM("vec-get", a, 2);
+  LASSERT_TYPE("vec-get", a, 0, LVAL_VEC);
+  LASSERT_TYPE("vec-get", a, 1, LVAL_NUM);
+  lval* v = a->cell[0];
+  long i = lval_to_num(a->cell[1]);
+  LASSERT(a, i >= 0 && i < v->len,
+    "Function 'vec-get' index %li is out of range for a vector of %li. D'oh!", i, v->len);
+
+  int64_t x = v->data[i];
+  lval_del(a);
+  return lval_num(x);
+}
+
+/* Elements start up to but not including end */
+lval* builtin_vec_slice(lenv* e, lval* a) {
+  LASSERT_NUM("vec-slice", a, 3);
+  LASSERT_TYPE("vec-slice", a, 0, LVAL_VEC);
+  LASSERT_TYPE("vec-slice", a, 1, LVAL_NUM);
+  LASSERT_TYPE("vec-slice", a, 2, LVAL_NUM);
+  lval* v = a->cell[0];
+  long start = lval_to_num(a->cell[1]), end = lval_to_num(a->cell[2]);
+  LASSERT(a, start >= 0 && start <= end && end <= v->len,
+    "Function 'vec-slice' range %li to %li is out of range for a vector of %li. D'oh!",
+    start, end, v->len);
+
+  lval* x = lval_vec(end - start);
+  LASSERT_VEC_ALLOC("vec-slice", a, x, end - start);
+  memcpy(x->data, v->data + start, sizeof(int64_t) * (end - start));
   lval_del(a);
   return x;
 }
 
-lval* builtin_add(lenv* e, lval* a) { return builtin_op(e, a, "+"); }
-lval* builtin_sub(lenv* e, lval* a) { return builtin_op(e, a, "-"); }
-lval* builtin_mul(lenv* e, lval* a) { return builtin_op(e, a, "*"); }
-lval* builtin_div(lenv* e, lval* a) { return builtin_op(e, a, "/"); }
+/* Apply an elementwise kernel to a vector and either a vector of the same */
+/* length or a number. A vector used nowhere else is overwritten in place. */
+static lval* builtin_vec_arith(lval* a, char* func,
+    int (*kernel)(int64_t*, const int64_t*, const int64_t*, int, long)) {
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_VEC);
+  lval* x = a->cell[0];
+  lval* y = a->cell[1];
+
+  int64_t k;
+  const int64_t* ys;
+  int ystep;
+  if (lval_type(y) == LVAL_NUM) {
+    k = lval_to_num(y);
+    ys = &k;
+    ystep = 0;
+  } else {
+    LASSERT_TYPE(func, a, 1, LVAL_VEC);
+    LASSERT(a, x->len == y->len,
+      "Function '%s' passed vectors of different lengths. Got %li and %li.", func, x->len, y->len);
+    ys = y->data;
+    ystep = 1;
+  }
+
+  lval* r = x->refs == 1 ? lval_copy(x) : lval_vec(x->len);
+  LASSERT_VEC_ALLOC(func, a, r, x->len);
+  int status = kernel(r->data, x->data, ys, ystep, x->len);
+  if (status) {
+    lval_del(r);
+    lval_del(a);
+    return status == 2
+      ? lval_err("You can't divide by zero, that's unpossible!")
+      : lval_err("Function '%s' overflowed. Ah, sweet merciful numbers!", func);
+  }
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_vec_add(lenv* e, lval* a) { return builtin_vec_arith(a, "vec+", lvec_add); }
+lval* builtin_vec_sub(lenv* e, lval* a) { return builtin_vec_arith(a, "vec-", lvec_sub); }
+lval* builtin_vec_mul(lenv* e, lval* a) { return builtin_vec_arith(a, "vec*", lvec_mul); }
+lval* builtin_vec_div(lenv* e, lval* a) { return builtin_vec_arith(a, "vec/", lvec_div); }
+
+lval* builtin_vec_sum(lenv* e, lval* a) {
+  LASSERT_NUM("vec-sum", a, 1);
+  LASSERT_TYPE("vec-sum", a, 0, LVAL_VEC);
+  int64_t x;
+  if (lvec_sum(a->cell[0]->data, a->cell[0]->len, &x)) { LVAL_OVERFLOW("vec-sum", a); }
+  lval_del(a);
+  return lval_num(x);
+}
+
+lval* builtin_vec_dot(lenv* e, lval* a) {
+  LASSERT_NUM("vec-dot", a, 2);
+  LASSERT_TYPE("vec-dot", a, 0, LVAL_VEC);
+  LASSERT_TYPE("vec-dot", a, 1, LVAL_VEC);
+  lval* x = a->cell[0];
+  lval* y = a->cell[1];
+  LASSERT(a, x->len == y->len,
+    "Function 'vec-dot' passed vectors of different lengths. Got %li and %li.", x->len, y->len);
+
+  int64_t r;
+  if (lvec_dot(x->data, y->data, x->len, &r)) { LVAL_OVERFLOW("vec-dot", a); }
+  lval_del(a);
+  return lval_num(r);
+}
+
+static lval* builtin_vec_pick(lval* a, char* func, int64_t (*pick)(const int64_t*, long)) {
+  LASSERT_NUM(func, a, 1);
+  LASSERT_TYPE(func, a, 0, LVAL_VEC);
+  LASSERT(a, a->cell[0]->len > 0, "Function '%s' passed an empty vector.", func);
+  int64_t x = pick(a->cell[0]->data, a->cell[0]->len);
+  lval_del(a);
+  return lval_num(x);
+}
+
+lval* builtin_vec_min(lenv* e, lval* a) { return builtin_vec_pick(a, "vec-min", lvec_min); }
+lval* builtin_vec_max(lenv* e, lval* a) { return builtin_vec_pick(a, "vec-max", lvec_max); }
 
 lval* builtin_var(lenv* e, lval* a, char* func) {
 
@@ -638,9 +2352,9 @@ lval* builtin_var(lenv* e, lval* a, char* func) {
 
   /* Ensure all elements of first list are symbols */
   for (int i = 0; i < syms->count; i++) {
-    LASSERT(a, syms->cell[i]->type == LVAL_SYM,
+    LASSERT(a, lval_type(syms->cell[i]) == LVAL_SYM,
       "%s? What's that symbol? (Got %s, (Expected %s)", func,
-      ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+      ltype_name(lval_type(syms->cell[i])), ltype_name(LVAL_SYM));
   }
 
   /* Check correct number of symbols and values */
@@ -651,6 +2365,15 @@ lval* builtin_var(lenv* e, lval* a, char* func) {
 
   /* Assign copies of values to symbols */
   for (int i = 0; i < syms->count; i++) {
+    /* Functions are known by the first name they are given, for the */
+    /* profiler. One that is shared is copied first, so naming it here */
+    /* does not rename it wherever else it is held. */
+    lval* v = a->cell[i+1];
+    if (lval_type(v) == LVAL_FUN && !v->name) {
+      v = a->cell[i+1] = lval_mut(v);
+      v->name = syms->cell[i]->sym;
+    }
+
     /* if 'def' define in globally. if 'put' define in locally */
     if (strcmp(func, "doh") == 0) {
       lenv_def(e, syms->cell[i], a->cell[i+1]);
@@ -669,112 +2392,582 @@ lval* builtin_def(lenv* e, lval* a) { return builtin_var(e, a, "doh"); }
 lval* builtin_put(lenv* e, lval* a) { return builtin_var(e, a, "="); }
 
 /* Comparison operators: Greater or Lesser */
-lval* builtin_ord(lenv* e, lval* a, char* op) {
-  LASSERT_NUM(op, a, 2); // ensure there are exactly two arguments
-  LASSERT_TYPE(op, a, 0, LVAL_NUM); // ensure both arguments are numbers
-  LASSERT_TYPE(op, a, 1, LVAL_NUM);
-
-  int r;
-  if (strcmp(op, ">") == 0) {
-    r = (a->cell[0]->num > a->cell[1]->num);
-  }
-  if (strcmp(op, "<") == 0) {
-    r = (a->cell[0]->num < a->cell[1]->num);
-  }
-  if (strcmp(op, ">=") == 0) {
-    r = (a->cell[0]->num >= a->cell[1]->num);
-  }
-  if (strcmp(op, "<=") == 0) {
-    r = (a->cell[0]->num <= a->cell[1]->num);
+#define LVAL_ORD(name, func, op) \
+  lval* name(lenv* e, lval* a) { \
+    LASSERT_NUM(func, a, 2); \
+    LASSERT_TYPE(func, a, 0, LVAL_NUM); \
+    LASSERT_TYPE(func, a, 1, LVAL_NUM); \
+    int r = lval_to_num(a->cell[0]) op lval_to_num(a->cell[1]); \
+    lval_del(a); \
+    return lval_num(r); \
   }
+
+LVAL_ORD(builtin_gt, ">", >)
+LVAL_ORD(builtin_lt, "<", <)
+LVAL_ORD(builtin_ge, ">=", >=)
+LVAL_ORD(builtin_le, "<=", <=)
+
+/* Comparison operators: Equality */
+lval* builtin_eq(lenv* e, lval* a) {
+  LASSERT_NUM("==", a, 2);
+  int r = lval_eq(a->cell[0], a->cell[1]);
   lval_del(a);
   return lval_num(r);
 }
-lval* builtin_gt(lenv* e, lval* a) { return builtin_ord(e, a, ">"); }
-lval* builtin_lt(lenv* e, lval* a) { return builtin_ord(e, a, "<"); }
-lval* builtin_ge(lenv* e, lval* a) { return builtin_ord(e, a, ">="); }
-lval* builtin_le(lenv* e, lval* a) { return builtin_ord(e, a, "<="); }
 
-/* Comparison operators: Equality */
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-  LASSERT_NUM(op, a, 2); // ensure there are exactly two arguments
-
-  int r;
-  if (strcmp(op, "==") == 0) {
-    r = lval_eq(a->cell[0], a->cell[1]);
-  }
-  if (strcmp(op, "!=") == 0) {
-    r = !lval_eq(a->cell[0], a->cell[1]);
-  }
+lval* builtin_ne(lenv* e, lval* a) {
+  LASSERT_NUM("!=", a, 2);
+  int r = !lval_eq(a->cell[0], a->cell[1]);
   lval_del(a);
   return lval_num(r);
 }
-lval* builtin_eq(lenv* e, lval* a) { return builtin_cmp(e, a, "=="); }
-lval* builtin_ne(lenv* e, lval* a) { return builtin_cmp(e, a, "!="); }
 
-/* Comparison Function: "if" */
-lval* builtin_if(lenv* e, lval* a) {
-  LASSERT_NUM("if", a, 3); // takes exactly three arguments
-  LASSERT_TYPE("if", a, 0, LVAL_NUM); // first argument is a number (condition)
-  LASSERT_TYPE("if", a, 1, LVAL_QEXPR); // second argument is a Q-expression (then branch)
-  LASSERT_TYPE("if", a, 2, LVAL_QEXPR); // third argument is a Q-expression (else branch)
+/* Strings */
+/* Substrings and the pieces split from a string are views into its storage, */
+/* so taking them copies nothing. */
 
-  /* Mark both expressions as evaluable */
-  lval* x;
-  a->cell[1]->type = LVAL_SEXPR;
-  a->cell[2]->type = LVAL_SEXPR;
+#define LASSERT_STRS(func, args) \
+  for (int i = 0; i < args->count; i++) { LASSERT_TYPE(func, args, i, LVAL_STR); }
 
-  if (a->cell[0]->num) {
-    /* If condition is true, evaluate the "then" branch */
-    x = lval_eval(e, lval_pop(a, 1));
-  } else {
-    /* Otherwise evaluate the "else" branch */
-    x = lval_eval(e, lval_pop(a, 2));
+lval* builtin_str_len(lenv* e, lval* a) {
+  LASSERT_NUM("str-len", a, 1);
+  LASSERT_TYPE("str-len", a, 0, LVAL_STR);
+  long n = a->cell[0]->size;
+  lval_del(a);
+  return lval_num(n);
+}
+
+/* Join strings end to end. Appending to the first in place where there is */
+/* room means building a string up a piece at a time is not quadratic. */
+lval* builtin_str_concat(lenv* e, lval* a) {
+  LASSERT_STRS("str-concat", a);
+  if (a->count == 0) { lval_del(a); return lval_str(""); }
+
+  lval* x = lval_pop(a, 0);
+  for (int i = 0; i < a->count; i++) {
+    x = lval_str_append(x, a->cell[i]->str, a->cell[i]->size);
   }
+  lval_del(a);
+  return x;
+}
 
-  /* Delete the argument list and return */
+/* Bytes start up to but not including end */
+lval* builtin_str_slice(lenv* e, lval* a) {
+  LASSERT_NUM("str-slice", a, 3);
+  LASSERT_TYPE("str-slice", a, 0, LVAL_STR);
+  LASSERT_TYPE("str-slice", a, 1, LVAL_NUM);
+  LASSERT_TYPE("str-slice", a, 2, LVAL_NUM);
+  lval* s = a->cell[0];
+  long start = lval_to_num(a->cell[1]), end = lval_to_num(a->cell[2]);
+  LASSERT(a, start >= 0 && start <= end && end <= s->size,
+    "Function 'str-slice' range %li to %li is out of range for a string of %li. D'oh!",
+    start, end, s->size);
+
+  lval* x = lval_str_view(s, start, end - start);
   lval_del(a);
   return x;
 }
 
-lval* lval_read(mpc_ast_t* t); // forward declaration
+/* Index of the first n bytes at needle in the size bytes at s, or -1 */
+static long lstr_find(const char* s, long size, const char* needle, long n) {
+  if (n == 0) { return 0; }
+  const char* end = s + size - n + 1;
+  for (const char* p = s; p < end; p++) {
+    p = memchr(p, needle[0], end - p);
+    if (!p) { break; }
+    if (memcmp(p, needle, n) == 0) { return p - s; }
+  }
+  return -1;
+}
 
-lval* builtin_load(lenv* e, lval* a) {
-  LASSERT_NUM("load", a, 1);
-  LASSERT_TYPE("load", a, 0, LVAL_STR);
+/* Index of the first place the second string appears in the first, or -1 */
+lval* builtin_str_find(lenv* e, lval* a) {
+  LASSERT_NUM("str-find", a, 2);
+  LASSERT_STRS("str-find", a);
+  lval* s = a->cell[0];
+  lval* needle = a->cell[1];
+  long i = lstr_find(s->str, s->size, needle->str, needle->size);
+  lval_del(a);
+  return lval_num(i);
+}
 
-  /* Parse file given by string name */
-  mpc_result_t r;
-  if (mpc_parse_contents(a->cell[0]->str, Sneed, &r)) {
+/* The pieces of the first string between each place the second appears */
+lval* builtin_str_split(lenv* e, lval* a) {
+  LASSERT_NUM("str-split", a, 2);
+  LASSERT_STRS("str-split", a);
+  lval* s = a->cell[0];
+  lval* sep = a->cell[1];
+  LASSERT(a, sep->size > 0, "Function 'str-split' passed an empty separator. D'oh!");
+
+  lval* x = lval_qexpr();
+  long start = 0;
+  for (;;) {
+    long i = lstr_find(s->str + start, s->size - start, sep->str, sep->size);
+    if (i < 0) { break; }
+    x = lval_add(x, lval_str_view(s, start, i));
+    start += i + sep->size;
+  }
+  x = lval_add(x, lval_str_view(s, start, s->size - start));
+  lval_del(a);
+  return x;
+}
 
-    /* Read contents */
-    lval* expr = lval_read(r.output);
-    mpc_ast_delete(r.output);
+/* The strings in a list joined end to end with the second string between */
+/* each, written into storage allocated once at its full size */
+lval* builtin_str_join(lenv* e, lval* a) {
+  LASSERT_NUM("str-join", a, 2);
+  LASSERT_TYPE("str-join", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("str-join", a, 1, LVAL_STR);
+  lval* q = a->cell[0];
+  lval* sep = a->cell[1];
+  long size = 0;
+  for (int i = 0; i < q->count; i++) {
+    LASSERT(a, lval_type(q->cell[i]) == LVAL_STR,
+      "Function 'str-join' passed a list with a %s in it. Only strings can be joined.",
+      ltype_name(lval_type(q->cell[i])));
+    size += q->cell[i]->size + (i ? sep->size : 0);
+  }
 
-    /* Evaluate each expression */
-    while (expr->count) {
-      lval* x = lval_eval(e, lval_pop(expr, 0));
+  lval* x = lval_str_len(NULL, size);
+  char* o = x->str;
+  for (int i = 0; i < q->count; i++) {
+    if (i) { memcpy(o, sep->str, sep->size); o += sep->size; }
+    memcpy(o, q->cell[i]->str, q->cell[i]->size);
+    o += q->cell[i]->size;
+  }
+  lval_del(a);
+  return x;
+}
 
-      /* If Evaluation leads to error print it */
-      if (x->type == LVAL_ERR) { lval_println(x); }
-      lval_del(x);
-    }
+/* Parse the n bytes at s as a whole decimal number, returning 0 if they */
+/* are not one or it does not fit in a long */
+static int lstr_to_num(const char* s, long n, long* out) {
+  const char* end = s + n;
+  int neg = s < end && *s == '-';
+  if (neg) { s++; }
+  if (s == end) { return 0; }
+
+  unsigned long limit = neg ? (unsigned long)LONG_MAX + 1 : (unsigned long)LONG_MAX;
+  unsigned long x = 0;
+  for (; s < end; s++) {
+    if (*s < '0' || *s > '9') { return 0; }
+    unsigned long d = *s - '0';
+    if (x > (limit - d) / 10) { return 0; }
+    x = x * 10 + d;
+  }
+  *out = neg ? -(long)(x - 1) - 1 : (long)x;
+  return 1;
+}
 
-    /* Delete expressions and arguments */
-    lval_del(expr);
-    lval_del(a);
+lval* builtin_str_num(lenv* e, lval* a) {
+  LASSERT_NUM("str->num", a, 1);
+  LASSERT_TYPE("str->num", a, 0, LVAL_STR);
+  long x;
+  LASSERT(a, lstr_to_num(a->cell[0]->str, a->cell[0]->size, &x),
+    "Function 'str->num' passed a string that is not a number. Invalid number! Smithers! Release the hounds!");
+  lval_del(a);
+  return lval_num(x);
+}
 
-    /* Return empty list */
-    return lval_sexpr();
+lval* builtin_num_str(lenv* e, lval* a) {
+  LASSERT_NUM("num->str", a, 1);
+  LASSERT_TYPE("num->str", a, 0, LVAL_NUM);
+  char buf[24];
+  int n = snprintf(buf, sizeof(buf), "%li", lval_to_num(a->cell[0]));
+  lval_del(a);
+  return lval_str_len(buf, n);
+}
 
-  } else {
-    /* Get Parse Error as String */
-    char* err_msg = mpc_err_string(r.error);
-    mpc_err_delete(r.error);
+/* Maps */
+/* Keys are numbers, strings and symbols. Putting or deleting a key gives */
+/* a new map and leaves the one passed in as it was. A symbol key is */
+/* passed quoted, as doh takes names, so {a} is the key a. */
+
+/* Replace a Q-Expression holding only a symbol with that symbol */
+static void lmap_unquote(lval* a, int i) {
+  lval* q = a->cell[i];
+  if (lval_type(q) != LVAL_QEXPR || q->count != 1 || lval_type(q->cell[0]) != LVAL_SYM) { return; }
+  a->cell[i] = lval_copy(q->cell[0]);
+  lval_del(q);
+}
 
-    /* Create new error message using it */
-    lval* err = lval_err("Could not load Library %s. Worst. Library. Ever.", err_msg);
-    free(err_msg);
+#define LASSERT_KEY(func, args, index) \
+  lmap_unquote(args, index); \
+  LASSERT(args, lval_type(args->cell[index]) == LVAL_NUM \
+    || lval_type(args->cell[index]) == LVAL_STR || lval_type(args->cell[index]) == LVAL_SYM, \
+    "Function '%s' passed a %s as a key. Only numbers, strings and symbols can be keys.", \
+    func, ltype_name(lval_type(args->cell[index])))
+
+/* Map from keys and values in turn, e.g. (dict "a" 1 {b} 2). An empty map */
+/* is (dict ()), the () a dummy argument as gc-stats takes. */
+lval* builtin_dict(lenv* e, lval* a) {
+  if (a->count == 1 && lval_type(a->cell[0]) == LVAL_SEXPR && a->cell[0]->count == 0) {
+    lval_del(a);
+    return lval_map();
+  }
+  LASSERT(a, a->count % 2 == 0,
+    "Function 'dict' passed a key with no value. Got %i arguments, Expected an even number.", a->count);
+  for (int i = 0; i < a->count; i += 2) { LASSERT_KEY("dict", a, i); }
+
+  lval* m = lval_map();
+  for (int i = 0; i < a->count; i += 2) {
+    m = lval_map_set(m, lval_copy(a->cell[i]), lval_copy(a->cell[i + 1]));
+  }
+  lval_del(a);
+  return m;
+}
+
+/* The value of a key, or the third argument if given when it has none */
+lval* builtin_dict_get(lenv* e, lval* a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+    "Function 'dict-get' passed incorrect number of arguments. Got %i, Expected 2 or 3.", a->count);
+  LASSERT_TYPE("dict-get", a, 0, LVAL_MAP);
+  LASSERT_KEY("dict-get", a, 1);
+  lval* m = a->cell[0];
+  int i = lmap_find(m, a->cell[1]);
+  if (i < 0 && a->count == 3) { return lval_take(a, 2); }
+  LASSERT(a, i >= 0, "Function 'dict-get' could not find the key. D'oh!");
+
+  lval* x = lval_copy(m->map->entries[i].val);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_dict_has(lenv* e, lval* a) {
+  LASSERT_NUM("dict-has", a, 2);
+  LASSERT_TYPE("dict-has", a, 0, LVAL_MAP);
+  LASSERT_KEY("dict-has", a, 1);
+  int has = lmap_find(a->cell[0], a->cell[1]) >= 0;
+  lval_del(a);
+  return lval_num(has);
+}
+
+lval* builtin_dict_put(lenv* e, lval* a) {
+  LASSERT_NUM("dict-put", a, 3);
+  LASSERT_TYPE("dict-put", a, 0, LVAL_MAP);
+  LASSERT_KEY("dict-put", a, 1);
+  lval* m = lval_pop(a, 0);
+  lval* k = lval_pop(a, 0);
+  return lval_map_set(m, k, lval_take(a, 0));
+}
+
+lval* builtin_dict_del(lenv* e, lval* a) {
+  LASSERT_NUM("dict-del", a, 2);
+  LASSERT_TYPE("dict-del", a, 0, LVAL_MAP);
+  LASSERT_KEY("dict-del", a, 1);
+  lval* m = lval_pop(a, 0);
+  return lval_map_set(m, lval_take(a, 0), NULL);
+}
+
+lval* builtin_dict_size(lenv* e, lval* a) {
+  LASSERT_NUM("dict-size", a, 1);
+  LASSERT_TYPE("dict-size", a, 0, LVAL_MAP);
+  int n = a->cell[0]->keys;
+  lval_del(a);
+  return lval_num(n);
+}
+
+/* The keys or the values of a map, in the order they were last put */
+static lval* builtin_dict_list(lval* a, char* func, int values) {
+  LASSERT_NUM(func, a, 1);
+  LASSERT_TYPE(func, a, 0, LVAL_MAP);
+  lval* m = a->cell[0];
+  lval* x = lval_qexpr();
+  if (m->keys) { lval_cells_reserve(x, 0, m->keys); }
+  for (int i = 0; i < m->upto; i++) {
+    if (!lmap_live(m, i)) { continue; }
+    lmap_entry* y = &m->map->entries[i];
+    x = lval_add(x, lval_copy(values ? y->val : y->key));
+  }
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_dict_keys(lenv* e, lval* a) { return builtin_dict_list(a, "dict-keys", 0); }
+lval* builtin_dict_values(lenv* e, lval* a) { return builtin_dict_list(a, "dict-values", 1); }
+
+/* List Library */
+/* Native versions of the list functions the prelude defines, which it only */
+/* falls back on when these are missing. They keep the prelude's semantics: */
+/* elements are taken with (eval (head l)), as its "first" does, and */
+/* functions passed in are called through lval_call. */
+
+/* Element i of l as (eval (head ...)) gives it. Numbers, strings, vectors */
+/* and maps evaluate to themselves, so they are returned as they are. */
+static lval* lval_elem(lenv* e, lval* l, int i) {
+  lval* x = l->cell[i];
+  int t = lval_type(x);
+  if (t == LVAL_NUM || t == LVAL_STR || t == LVAL_VEC || t == LVAL_MAP) { return lval_copy(x); }
+  return lval_eval_list(e, lval_add(lval_qexpr(), lval_copy(x)));
+}
+
+/* Call f with the arguments x and y, or x alone if y is NULL */
+static lval* lval_call_with(lenv* e, lval* f, lval* x, lval* y) {
+  lval* a = lval_add(lval_sexpr(), x);
+  if (y) { a = lval_add(a, y); }
+  return lval_call(e, f, a);
+}
+
+#define LASSERT_INDEX(func, args, n, count) \
+  LASSERT(args, n >= 0 && n < count, \
+    "Function '%s' index %li is out of range for a list of %i. D'oh!", func, n, count)
+
+lval* builtin_len(lenv* e, lval* a) {
+  LASSERT_NUM("len", a, 1);
+  LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
+  int n = a->cell[0]->count;
+  lval_del(a);
+  return lval_num(n);
+}
+
+lval* builtin_nth(lenv* e, lval* a) {
+  LASSERT_NUM("nth", a, 2);
+  LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+  LASSERT_TYPE("nth", a, 1, LVAL_QEXPR);
+  long n = lval_to_num(a->cell[0]);
+  LASSERT_INDEX("nth", a, n, a->cell[1]->count);
+
+  lval* x = lval_elem(e, a->cell[1], n);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_last(lenv* e, lval* a) {
+  LASSERT_NUM("last", a, 1);
+  LASSERT_TYPE("last", a, 0, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("last", a, 0);
+
+  lval* x = lval_elem(e, a->cell[0], a->cell[0]->count - 1);
+  lval_del(a);
+  return x;
+}
+
+/* Check the arguments to take and drop: a count no longer than the list */
+#define LASSERT_COUNT(func, args) \
+  LASSERT_NUM(func, args, 2); \
+  LASSERT_TYPE(func, args, 0, LVAL_NUM); \
+  LASSERT_TYPE(func, args, 1, LVAL_QEXPR); \
+  LASSERT(args, lval_to_num(args->cell[0]) >= 0 && lval_to_num(args->cell[0]) <= args->cell[1]->count, \
+    "Function '%s' can't take %li elements from a list of %i. D'oh!", \
+    func, lval_to_num(args->cell[0]), args->cell[1]->count)
+
+lval* builtin_take(lenv* e, lval* a) {
+  LASSERT_COUNT("take", a);
+  int n = lval_to_num(a->cell[0]);
+  return lval_trunc(lval_take(a, 1), n);
+}
+
+lval* builtin_drop(lenv* e, lval* a) {
+  LASSERT_COUNT("drop", a);
+  int n = lval_to_num(a->cell[0]);
+  return lval_drop(lval_take(a, 1), n);
+}
+
+lval* builtin_elem(lenv* e, lval* a) {
+  LASSERT_NUM("elem", a, 2);
+  LASSERT_TYPE("elem", a, 1, LVAL_QEXPR);
+  lval* l = a->cell[1];
+
+  int r = 0;
+  for (int i = 0; i < l->count && !r; i++) {
+    lval* x = lval_elem(e, l, i);
+    if (lval_type(x) == LVAL_ERR) { lval_del(a); return x; }
+    r = lval_eq(a->cell[0], x);
+    lval_del(x);
+  }
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval* builtin_map(lenv* e, lval* a) {
+  LASSERT_NUM("map", a, 2);
+  LASSERT_TYPE("map", a, 0, LVAL_FUN);
+  LASSERT_TYPE("map", a, 1, LVAL_QEXPR);
+  lval* f = a->cell[0];
+  lval* l = a->cell[1];
+
+  lval* r = lval_qexpr();
+  if (l->count) { lval_cells_reserve(r, 0, l->count); }
+  for (int i = 0; i < l->count; i++) {
+    lval* x = lval_elem(e, l, i);
+    if (lval_type(x) != LVAL_ERR) { x = lval_call_with(e, f, x, NULL); }
+    if (lval_type(x) == LVAL_ERR) { lval_del(r); lval_del(a); return x; }
+    r = lval_add(r, x);
+  }
+  lval_del(a);
+  return r;
+}
+
+/* Keeps the elements themselves, not what they evaluate to */
+lval* builtin_filter(lenv* e, lval* a) {
+  LASSERT_NUM("filter", a, 2);
+  LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+  LASSERT_TYPE("filter", a, 1, LVAL_QEXPR);
+  lval* f = a->cell[0];
+  lval* l = a->cell[1];
+
+  lval* r = lval_qexpr();
+  for (int i = 0; i < l->count; i++) {
+    lval* x = lval_elem(e, l, i);
+    if (lval_type(x) != LVAL_ERR) { x = lval_call_with(e, f, x, NULL); }
+    if (lval_type(x) != LVAL_NUM) {
+      lval* err = lval_type(x) == LVAL_ERR ? x : lval_err(
+        "Function 'filter' needs its test to give a Number. Got %s. Stupid sexy Flanders!",
+        ltype_name(lval_type(x)));
+      if (err != x) { lval_del(x); }
+      lval_del(r);
+      lval_del(a);
+      return err;
+    }
+    if (lval_to_num(x)) { r = lval_add(r, lval_copy(l->cell[i])); }
+  }
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_foldleft(lenv* e, lval* a) {
+  LASSERT_NUM("foldleft", a, 3);
+  LASSERT_TYPE("foldleft", a, 0, LVAL_FUN);
+  LASSERT_TYPE("foldleft", a, 2, LVAL_QEXPR);
+  lval* f = a->cell[0];
+  lval* l = a->cell[2];
+
+  lval* acc = lval_copy(a->cell[1]);
+  for (int i = 0; i < l->count; i++) {
+    lval* x = lval_elem(e, l, i);
+    if (lval_type(x) == LVAL_ERR) { lval_del(acc); acc = x; break; }
+    acc = lval_call_with(e, f, acc, x);
+    if (lval_type(acc) == LVAL_ERR) { break; }
+  }
+  lval_del(a);
+  return acc;
+}
+
+/* The elements are all evaluated first, left to right, as the prelude's */
+/* recursion does before making any of the calls */
+lval* builtin_foldright(lenv* e, lval* a) {
+  LASSERT_NUM("foldright", a, 3);
+  LASSERT_TYPE("foldright", a, 0, LVAL_FUN);
+  LASSERT_TYPE("foldright", a, 2, LVAL_QEXPR);
+  lval* f = a->cell[0];
+  lval* l = a->cell[2];
+
+  lval* xs = lval_qexpr();
+  if (l->count) { lval_cells_reserve(xs, 0, l->count); }
+  for (int i = 0; i < l->count; i++) {
+    lval* x = lval_elem(e, l, i);
+    if (lval_type(x) == LVAL_ERR) { lval_del(xs); lval_del(a); return x; }
+    xs = lval_add(xs, x);
+  }
+
+  lval* acc = lval_copy(a->cell[1]);
+  for (int i = xs->count - 1; i >= 0 && lval_type(acc) != LVAL_ERR; i--) {
+    acc = lval_call_with(e, f, lval_copy(xs->cell[i]), acc);
+  }
+  lval_del(xs);
+  lval_del(a);
+  return acc;
+}
+
+/* Sum or multiply the elements of the list in a, as foldleft with + or * */
+/* would, checking for overflow the same way */
+static lval* lval_fold_nums(lenv* e, lval* a, char* func, int mul) {
+  LASSERT_NUM(func, a, 1);
+  LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+  lval* l = a->cell[0];
+
+  long r;
+  if (!mul && lval_sum_small(l->cell, l->count, &r)) {
+    lval_del(a);
+    return lval_num(r);
+  }
+
+  r = mul ? 1 : 0;
+  for (int i = 0; i < l->count; i++) {
+    lval* x = lval_elem(e, l, i);
+    if (lval_type(x) != LVAL_NUM) {
+      lval* err = lval_type(x) == LVAL_ERR ? x : lval_err(
+        "Function '%s' passed incorrect type for element %i. Got %s, Expected %s.",
+        func, i, ltype_name(lval_type(x)), ltype_name(LVAL_NUM));
+      if (err != x) { lval_del(x); }
+      lval_del(a);
+      return err;
+    }
+    long y = lval_to_num(x);
+    lval_del(x);
+    if (mul ? __builtin_mul_overflow(r, y, &r) : __builtin_add_overflow(r, y, &r)) {
+      LVAL_OVERFLOW(func, a);
+    }
+  }
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval* builtin_sum(lenv* e, lval* a) { return lval_fold_nums(e, a, "sum", 0); }
+lval* builtin_product(lenv* e, lval* a) { return lval_fold_nums(e, a, "product", 1); }
+
+/* True if the symbol in the list is bound, e.g. (defined {len}) */
+lval* builtin_defined(lenv* e, lval* a) {
+  LASSERT_NUM("defined", a, 1);
+  LASSERT_TYPE("defined", a, 0, LVAL_QEXPR);
+  LASSERT(a, a->cell[0]->count == 1 && lval_type(a->cell[0]->cell[0]) == LVAL_SYM,
+    "Function 'defined' needs a list of one symbol.");
+
+  lval* x = lenv_get(e, a->cell[0]->cell[0]);
+  int r = lval_type(x) != LVAL_ERR;
+  lval_del(x);
+  lval_del(a);
+  return lval_num(r);
+}
+
+/* Check the arguments to if, returning the branch the condition selects */
+lval* lval_if_branch(lval* a) {
+  LASSERT_NUM("if", a, 3); // takes exactly three arguments
+  LASSERT_TYPE("if", a, 0, LVAL_NUM); // first argument is a number (condition)
+  LASSERT_TYPE("if", a, 1, LVAL_QEXPR); // second argument is a Q-expression (then branch)
+  LASSERT_TYPE("if", a, 2, LVAL_QEXPR); // third argument is a Q-expression (else branch)
+
+  /* The "then" branch if the condition is true, otherwise the "else" branch */
+  return lval_take(a, lval_to_num(a->cell[0]) ? 1 : 2);
+}
+
+/* Comparison Function: "if" */
+lval* builtin_if(lenv* e, lval* a) {
+  lval* x = lval_if_branch(a);
+  if (lval_type(x) == LVAL_ERR) { return x; }
+  return lval_eval_list(e, x);
+}
+
+lval* lval_read_file(char* filename); // forward declaration
+
+lval* builtin_load(lenv* e, lval* a) {
+  LASSERT_NUM("load", a, 1);
+  LASSERT_TYPE("load", a, 0, LVAL_STR);
+
+  /* Read file given by string name */
+  lval* expr = lval_read_file(lval_str_cstr(a->cell[0]));
+  if (lval_type(expr) != LVAL_ERR) {
+
+    /* Evaluate each expression */
+    while (expr->count) {
+      lval* x = lval_eval(e, lval_pop(expr, 0));
+
+      /* If Evaluation leads to error print it */
+      if (lval_type(x) == LVAL_ERR) { lval_println(x); }
+      lval_del(x);
+    }
+
+    /* Delete expressions and arguments */
+    lval_del(expr);
+    lval_del(a);
+
+    /* Return empty list */
+    return lval_sexpr();
+
+  } else {
+    /* Create new error message using the read error */
+    lval* err = lval_err("Could not load Library %s. Worst. Library. Ever.", expr->err);
+    lval_del(expr);
     lval_del(a);
 
     /* Cleanup and return error */
@@ -782,293 +2975,2755 @@ lval* builtin_load(lenv* e, lval* a) {
   }
 }
 
-lval* builtin_print(lenv* e, lval* a) {
+lval* builtin_print(lenv* e, lval* a) {
+
+  /* Print each argument followed by a space, all written out at once */
+  lbuf* b = lprint_stdout();
+  for (int i = 0; i < a->count; i++) {
+    lbuf_val(b, a->cell[i]);
+    lbuf_putc(b, '\n');
+    lbuf_putc(b, ' ');
+  }
+
+  /* Print a newline and delete arguments */
+  lbuf_putc(b, '\n');
+  lbuf_flush(b);
+  lval_del(a);
+
+  return lval_sexpr();
+}
+
+lval* builtin_show(lenv* e, lval* a) {
+  LASSERT_NUM("show", a, 1);
+  lval* x = lval_show(a->cell[0]);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_error(lenv* e, lval* a) {
+  LASSERT_NUM("error", a, 1);
+  LASSERT_TYPE("error", a, 0, LVAL_STR);
+
+  /* Construct Error from first argument, which is not a format */
+  lval* err = lval_err("%s", lval_str_cstr(a->cell[0]));
+
+  /* Delete arguments and return */
+  lval_del(a);
+  return err;
+}
+
+/* Add a {name value} pair to a Q-Expression of statistics */
+lval* lval_add_stat(lval* v, char* name, long x) {
+  return lval_add(v, lval_add(lval_add(lval_qexpr(), lval_sym(name)), lval_num(x)));
+}
+
+/* Takes a dummy argument, e.g. (gc-stats ()), as a call needs at least one */
+lval* builtin_gc_stats(lenv* e, lval* a) {
+  lval_del(a);
+
+  lval* v = lval_qexpr();
+  v = lval_add_stat(v, "allocations", (long)lmem_allocs);
+  v = lval_add_stat(v, "collections", lgc_collections);
+  v = lval_add_stat(v, "pause-total-us", (long)lgc_pause_total);
+  v = lval_add_stat(v, "pause-max-us", (long)lgc_pause_max);
+  v = lval_add_stat(v, "reclaimed", lgc_reclaimed);
+  v = lval_add_stat(v, "pending", lgc_dead_count);
+  v = lval_add_stat(v, "live-values", lgc_live);
+  v = lval_add_stat(v, "live-bytes", lmem_bytes);
+  v = lval_add_stat(v, "threshold", lgc_threshold);
+  v = lval_add_stat(v, "step", lgc_step);
+  return v;
+}
+
+lval* builtin_gc_tune(lenv* e, lval* a) {
+  LASSERT_NUM("gc-tune", a, 2);
+  LASSERT_TYPE("gc-tune", a, 0, LVAL_NUM);
+  LASSERT_TYPE("gc-tune", a, 1, LVAL_NUM);
+  LASSERT(a, lval_to_num(a->cell[0]) > 0 && lval_to_num(a->cell[1]) > 0,
+    "Function 'gc-tune' needs a positive threshold and step.");
+
+  lgc_threshold = lval_to_num(a->cell[0]);
+  lgc_step = lval_to_num(a->cell[1]);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* Names of the kinds counted by the memory accounting */
+static char* lmem_kind_names[LMEM_KINDS] = {
+  "error", "number", "symbol", "string", "function", "sexpr", "qexpr", "vector",
+  "map", "environment", "cells", "chars", "table"
+};
+
+/* Takes a dummy argument, as gc-stats does. Gives the counts for each kind, */
+/* then the most bytes ever in use at once. */
+lval* builtin_mem_stats(lenv* e, lval* a) {
+  lval_del(a);
+
+  lval* v = lval_qexpr();
+  for (int i = 0; i < LMEM_KINDS; i++) {
+    lval* k = lval_add(lval_qexpr(), lval_sym(lmem_kind_names[i]));
+    k = lval_add_stat(k, "live", lmem_counts[i].live);
+    k = lval_add_stat(k, "allocations", (long)lmem_counts[i].allocs);
+    k = lval_add_stat(k, "frees", (long)lmem_counts[i].frees);
+    k = lval_add_stat(k, "bytes", lmem_counts[i].bytes);
+    v = lval_add(v, k);
+  }
+  return lval_add_stat(v, "peak-bytes", lmem_peak);
+}
+
+/* Print the counts as a table, as the --mem-stats option does at exit */
+void lmem_print_stats(FILE* out) {
+  lmem_count total = { 0, 0, 0, 0 };
+  fprintf(out, "%-12s %12s %12s %12s %12s\n", "kind", "live", "allocations", "frees", "bytes");
+  for (int i = 0; i < LMEM_KINDS; i++) {
+    lmem_count* c = &lmem_counts[i];
+    fprintf(out, "%-12s %12li %12lu %12lu %12li\n", lmem_kind_names[i], c->live, c->allocs, c->frees, c->bytes);
+    total.live += c->live;
+    total.allocs += c->allocs;
+    total.frees += c->frees;
+    total.bytes += c->bytes;
+  }
+  fprintf(out, "%-12s %12li %12lu %12lu %12li\n", "total", total.live, total.allocs, total.frees, total.bytes);
+  fprintf(out, "peak bytes %li\n", lmem_peak);
+}
+
+/* Memoization */
+/* (memo f) wraps f in a cache of its results, keyed on the arguments as */
+/* lval_eq compares them. Recursive functions look themselves up by name, so */
+/* (doh {fib} (memo fib)) caches the recursive calls too. The cache is a */
+/* chained hash table whose entries are also kept in order of use, most */
+/* recent first, so the least recently used is evicted once it is full. */
+#define LMEMO_DEFAULT_CAPACITY 4096
+
+typedef struct lmemo_entry lmemo_entry;
+
+struct lmemo_entry {
+  lval* args;
+  lval* result;
+  unsigned long hash;
+  lmemo_entry* chain; // next entry in the same bucket
+  lmemo_entry* prev;  // neighbours in order of use
+  lmemo_entry* next;
+};
+
+struct lmemo {
+  int refs;
+  lval* fn;
+  lmemo_entry** buckets;
+  long buckets_cap; // a power of two
+  long count;
+  long capacity;
+  lmemo_entry* newest;
+  lmemo_entry* oldest;
+  long hits;
+  long misses;
+  long evictions;
+};
+
+lval* lmemo_fn(lmemo* m) { return m->fn; }
+
+lmemo* lmemo_copy(lmemo* m) {
+  m->refs++;
+  return m;
+}
+
+static void lmemo_entry_del(lmemo_entry* x) {
+  lval_del(x->args);
+  lval_del(x->result);
+  free(x);
+}
+
+void lmemo_release(lmemo* m) {
+  if (--m->refs > 0) { return; }
+  for (lmemo_entry* x = m->newest; x; ) {
+    lmemo_entry* next = x->next;
+    lmemo_entry_del(x);
+    x = next;
+  }
+  free(m->buckets);
+  lval_del(m->fn);
+  free(m);
+}
+
+/* Take x out of the order of use */
+static void lmemo_unlink(lmemo* m, lmemo_entry* x) {
+  if (x->prev) { x->prev->next = x->next; } else { m->newest = x->next; }
+  if (x->next) { x->next->prev = x->prev; } else { m->oldest = x->prev; }
+}
+
+/* Put x first in the order of use */
+static void lmemo_push(lmemo* m, lmemo_entry* x) {
+  x->prev = NULL;
+  x->next = m->newest;
+  if (m->newest) { m->newest->prev = x; } else { m->oldest = x; }
+  m->newest = x;
+}
+
+static lmemo_entry* lmemo_find(lmemo* m, lval* args, unsigned long hash) {
+  if (!m->buckets) { return NULL; }
+  for (lmemo_entry* x = m->buckets[hash & (m->buckets_cap-1)]; x; x = x->chain) {
+    if (x->hash == hash && lval_eq(x->args, args)) { return x; }
+  }
+  return NULL;
+}
+
+static void lmemo_evict(lmemo* m) {
+  lmemo_entry* x = m->oldest;
+  lmemo_entry** p = &m->buckets[x->hash & (m->buckets_cap-1)];
+  while (*p != x) { p = &(*p)->chain; }
+  *p = x->chain;
+  lmemo_unlink(m, x);
+  lmemo_entry_del(x);
+  m->count--;
+  m->evictions++;
+}
+
+/* Add an entry, taking the references to args and result */
+static void lmemo_insert(lmemo* m, lval* args, lval* result, unsigned long hash) {
+  if (m->count == m->capacity) { lmemo_evict(m); }
+
+  /* Keep at most one entry per bucket on average */
+  if (m->count >= m->buckets_cap) {
+    long ncap = m->buckets_cap ? m->buckets_cap * 2 : 16;
+    lmemo_entry** nb = calloc(ncap, sizeof(lmemo_entry*));
+    for (lmemo_entry* x = m->newest; x; x = x->next) {
+      lmemo_entry** b = &nb[x->hash & (ncap-1)];
+      x->chain = *b;
+      *b = x;
+    }
+    free(m->buckets);
+    m->buckets = nb;
+    m->buckets_cap = ncap;
+  }
+
+  lmemo_entry* x = malloc(sizeof(lmemo_entry));
+  x->args = args;
+  x->result = result;
+  x->hash = hash;
+  lmemo_entry** b = &m->buckets[hash & (m->buckets_cap-1)];
+  x->chain = *b;
+  *b = x;
+  lmemo_push(m, x);
+  m->count++;
+}
+
+/* True if v is or holds a function, which could hold the cache in turn */
+static int lval_has_fun(lval* v) {
+  int t = lval_type(v);
+  if (t == LVAL_FUN) { return 1; }
+  if (t == LVAL_SEXPR || t == LVAL_QEXPR) {
+    for (int i = 0; i < v->count; i++) {
+      if (lval_has_fun(v->cell[i])) { return 1; }
+    }
+  }
+  if (t == LVAL_MAP) {
+    for (int i = 0; i < v->upto; i++) {
+      if (!lmap_live(v, i)) { continue; }
+      if (lval_has_fun(v->map->entries[i].key) || lval_has_fun(v->map->entries[i].val)) { return 1; }
+    }
+  }
+  return 0;
+}
+
+/* Call the memoized function f. Errors are not cached, and neither are */
+/* calls involving functions, as a cache that held itself would never be */
+/* freed. */
+lval* lmemo_call(lenv* e, lval* f, lval* a) {
+  lmemo* m = f->memo;
+  unsigned long hash = lval_hash(a);
+
+  lmemo_entry* x = lmemo_find(m, a, hash);
+  if (x) {
+    m->hits++;
+    lmemo_unlink(m, x);
+    lmemo_push(m, x);
+    lval_del(a);
+    return lval_copy(x->result);
+  }
+  m->misses++;
+
+  /* The function gets a list of its own, as builtins modify theirs */
+  lval* r = lval_call(e, m->fn, lval_dup(a));
+  if (lval_type(r) != LVAL_ERR && !lval_has_fun(a) && !lval_has_fun(r)) {
+    lmemo_insert(m, a, lval_copy(r), hash);
+  } else {
+    lval_del(a);
+  }
+  return r;
+}
+
+/* A memoized function wrapping fn, with an empty cache. Takes ownership of fn. */
+lval* lval_memo(lval* fn, long capacity) {
+  lmemo* m = calloc(1, sizeof(lmemo));
+  m->refs = 1;
+  m->fn = fn;
+  m->capacity = capacity;
+
+  lval* f = lval_builtin(NULL);
+  f->body = NULL;
+  f->memo = m;
+  return f;
+}
+
+/* Memoize a function, keeping up to the given number of results */
+lval* builtin_memo(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+    "Function 'memo' passed incorrect number of arguments. Got %i, Expected 1 or 2.", a->count);
+  LASSERT_TYPE("memo", a, 0, LVAL_FUN);
+  long capacity = LMEMO_DEFAULT_CAPACITY;
+  if (a->count == 2) {
+    LASSERT_TYPE("memo", a, 1, LVAL_NUM);
+    capacity = lval_to_num(a->cell[1]);
+    LASSERT(a, capacity > 0, "Function 'memo' needs room for at least one result. Got %li.", capacity);
+  }
+
+  lval* f = lval_memo(lval_copy(a->cell[0]), capacity);
+  lval_del(a);
+  return f;
+}
+
+lval* builtin_memo_stats(lenv* e, lval* a) {
+  LASSERT_NUM("memo-stats", a, 1);
+  LASSERT(a, lval_type(a->cell[0]) == LVAL_FUN && lval_is_memo(a->cell[0]),
+    "Function 'memo-stats' needs a memoized function. Got %s.", ltype_name(lval_type(a->cell[0])));
+
+  lmemo* m = a->cell[0]->memo;
+  lval* v = lval_qexpr();
+  v = lval_add_stat(v, "hits", m->hits);
+  v = lval_add_stat(v, "misses", m->misses);
+  v = lval_add_stat(v, "evictions", m->evictions);
+  v = lval_add_stat(v, "size", m->count);
+  v = lval_add_stat(v, "capacity", m->capacity);
+  lval_del(a);
+  return v;
+}
+
+/* Profiler */
+/* While profiling, every call of a builtin or named function is timed and */
+/* its allocations counted. Each function has a record of its calls, its */
+/* total time (counted once however deeply it recurses) and the time and */
+/* allocations spent in it rather than in what it called. A call tree is */
+/* kept as well, printed as folded stacks for flame graph tools, in which */
+/* a function calling itself directly is folded into one frame. A tail */
+/* call replaces the frame of the function it was made from, as the */
+/* function making it has finished. */
+#define LPROF_BUCKETS 256
+
+typedef struct lprof_fn lprof_fn;
+typedef struct lprof_node lprof_node;
+
+struct lprof_fn {
+  char* name;
+  unsigned long calls;
+  unsigned long allocs;  // made by the function itself
+  double total_us;
+  double self_us;
+  int active;            // calls of it on the stack
+  lprof_fn* next;        // in its bucket
+};
+
+struct lprof_node {
+  lprof_fn* fn;
+  double self_us;
+  lprof_node* child;     // first callee
+  lprof_node* sibling;   // next callee of the parent
+};
+
+typedef struct {
+  lprof_fn* fn;
+  lprof_node* node;
+  double start;
+  double child_us;
+  unsigned long allocs;  // the allocation count on entry
+  unsigned long child_allocs;
+} lprof_frame;
+
+static _Thread_local int lprof_on = 0;
+static _Thread_local lprof_fn* lprof_fns[LPROF_BUCKETS];
+static _Thread_local lprof_node lprof_root;
+static _Thread_local lprof_frame* lprof_stack = NULL;
+static _Thread_local int lprof_depth = 0;
+static _Thread_local int lprof_cap = 0;
+
+static lprof_fn* lprof_find(char* name) {
+  /* Names are interned, so the pointer is the key */
+  lprof_fn** b = &lprof_fns[((uintptr_t)name >> 4) % LPROF_BUCKETS];
+  for (lprof_fn* x = *b; x; x = x->next) {
+    if (x->name == name) { return x; }
+  }
+  lprof_fn* x = calloc(1, sizeof(lprof_fn));
+  x->name = name;
+  x->next = *b;
+  *b = x;
+  return x;
+}
+
+static lprof_node* lprof_child(lprof_node* n, lprof_fn* fn) {
+  if (n->fn == fn) { return n; }
+  for (lprof_node* c = n->child; c; c = c->sibling) {
+    if (c->fn == fn) { return c; }
+  }
+  lprof_node* c = calloc(1, sizeof(lprof_node));
+  c->fn = fn;
+  c->sibling = n->child;
+  n->child = c;
+  return c;
+}
+
+static void lprof_enter(lval* f) {
+  if (lprof_depth == lprof_cap) {
+    lprof_cap = lprof_cap ? lprof_cap * 2 : 64;
+    lprof_stack = realloc(lprof_stack, sizeof(lprof_frame) * lprof_cap);
+  }
+  lprof_fn* fn = lprof_find(f->name ? f->name : (f->builtin ? "<builtin>" : "<lambda>"));
+  fn->calls++;
+  fn->active++;
+
+  lprof_frame* p = &lprof_stack[lprof_depth++];
+  p->fn = fn;
+  p->node = lprof_child(lprof_depth > 1 ? p[-1].node : &lprof_root, fn);
+  p->child_us = 0;
+  p->child_allocs = 0;
+  p->allocs = lmem_allocs;
+  p->start = lgc_now_us();
+}
+
+static void lprof_leave(void) {
+  double elapsed = lgc_now_us();
+  lprof_frame* p = &lprof_stack[--lprof_depth];
+  elapsed -= p->start;
+  unsigned long allocs = lmem_allocs - p->allocs;
+
+  p->fn->self_us += elapsed - p->child_us;
+  p->fn->allocs += allocs - p->child_allocs;
+  p->node->self_us += elapsed - p->child_us;
+  if (--p->fn->active == 0) { p->fn->total_us += elapsed; }
+
+  if (lprof_depth > 0) {
+    p[-1].child_us += elapsed;
+    p[-1].child_allocs += allocs;
+  }
+}
+
+/* Call the builtin f, timing it */
+static lval* lprof_builtin(lenv* e, lval* f, lval* a) {
+  lprof_enter(f);
+  lval* r = f->builtin(e, a);
+  lprof_leave();
+  return r;
+}
+
+/* A tail call of f replaces the frame of the function making it, if it has one */
+static void lprof_tail(lval* f, int* profiled) {
+  if (*profiled) { lprof_leave(); }
+  lprof_enter(f);
+  *profiled = 1;
+}
+
+static void lprof_node_del(lprof_node* n) {
+  while (n) {
+    lprof_node* next = n->sibling;
+    lprof_node_del(n->child);
+    free(n);
+    n = next;
+  }
+}
+
+/* Forget everything recorded so far */
+void lprof_reset(void) {
+  for (int i = 0; i < LPROF_BUCKETS; i++) {
+    while (lprof_fns[i]) {
+      lprof_fn* next = lprof_fns[i]->next;
+      free(lprof_fns[i]);
+      lprof_fns[i] = next;
+    }
+  }
+  lprof_node_del(lprof_root.child);
+  lprof_root.child = NULL;
+  free(lprof_stack);
+  lprof_stack = NULL;
+  lprof_depth = lprof_cap = 0;
+}
+
+static int lprof_cmp(const void* x, const void* y) {
+  double a = (*(lprof_fn**)x)->self_us, b = (*(lprof_fn**)y)->self_us;
+  return (a < b) - (a > b);
+}
+
+/* Print a table of every function called, the most time spent in first */
+void lprof_print_flat(FILE* out) {
+  int n = 0;
+  for (int i = 0; i < LPROF_BUCKETS; i++) {
+    for (lprof_fn* x = lprof_fns[i]; x; x = x->next) { n++; }
+  }
+  lprof_fn** fns = malloc(sizeof(lprof_fn*) * (n ? n : 1));
+  n = 0;
+  for (int i = 0; i < LPROF_BUCKETS; i++) {
+    for (lprof_fn* x = lprof_fns[i]; x; x = x->next) { fns[n++] = x; }
+  }
+  qsort(fns, n, sizeof(lprof_fn*), lprof_cmp);
+
+  fprintf(out, "%12s %12s %12s %12s  %s\n", "calls", "total-ms", "self-ms", "allocs", "function");
+  for (int i = 0; i < n; i++) {
+    fprintf(out, "%12lu %12.3f %12.3f %12lu  %s\n", fns[i]->calls,
+      fns[i]->total_us / 1e3, fns[i]->self_us / 1e3, fns[i]->allocs, fns[i]->name);
+  }
+  free(fns);
+}
+
+/* Print the path to each node in the call tree with its own time in */
+/* microseconds, as "caller;callee 123" lines */
+static void lprof_print_node(FILE* out, lprof_node* n, char** path, size_t* cap, size_t len) {
+  for (; n; n = n->sibling) {
+    size_t name = strlen(n->fn->name);
+    if (len + name + 2 > *cap) {
+      *cap = (len + name + 2) * 2;
+      *path = realloc(*path, *cap);
+    }
+    size_t end = len;
+    if (len) { (*path)[end++] = ';'; }
+    memcpy(*path + end, n->fn->name, name);
+    end += name;
+    (*path)[end] = '\0';
+
+    long us = (long)(n->self_us + 0.5);
+    if (us > 0) { fprintf(out, "%s %li\n", *path, us); }
+    lprof_print_node(out, n->child, path, cap, end);
+  }
+}
+
+void lprof_print_folded(FILE* out) {
+  size_t cap = 256;
+  char* path = malloc(cap);
+  lprof_print_node(out, lprof_root.child, &path, &cap, 0);
+  free(path);
+}
+
+/* Write the folded stacks to the named file, returning 0 if it could not be opened */
+int lprof_write_folded(char* filename) {
+  FILE* f = fopen(filename, "w");
+  if (!f) { return 0; }
+  lprof_print_folded(f);
+  fclose(f);
+  return 1;
+}
+
+/* Profile the evaluation of an expression, printing the table once it is */
+/* done and writing the folded stacks to a file if given one. Within a */
+/* profile already running the expression is just evaluated. */
+lval* builtin_profile(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+    "Function 'profile' passed incorrect number of arguments. Got %i, Expected 1 or 2.", a->count);
+  LASSERT_TYPE("profile", a, 0, LVAL_QEXPR);
+  if (a->count == 2) { LASSERT_TYPE("profile", a, 1, LVAL_STR); }
+
+  lval* x = lval_pop(a, 0);
+  if (lprof_on) {
+    lval_del(a);
+    return lval_eval_list(e, x);
+  }
+
+  lprof_reset();
+  lprof_on = 1;
+  lval* r = lval_eval_list(e, x);
+  lprof_on = 0;
+
+  lprof_print_flat(stdout);
+  if (a->count == 1 && !lprof_write_folded(lval_str_cstr(a->cell[0]))) {
+    lval_del(r);
+    r = lval_err("Function 'profile' could not write to '%s'. Me fail English? That's unpossible!", a->cell[0]->str);
+  }
+  lprof_reset();
+  lval_del(a);
+  return r;
+}
+
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+  lval* k = lval_sym(name);
+  lval* v = lval_builtin(func);
+  v->name = k->sym;
+  lenv_put(e, k, v);
+  lval_del(k);
+  lval_del(v);
+}
+
+lval* builtin_pmap(lenv* e, lval* a); // forward declaration
+lval* builtin_preduce(lenv* e, lval* a); // forward declaration
+lval* builtin_threads(lenv* e, lval* a); // forward declaration
+
+void lenv_add_builtins(lenv* e) {
+  /* List Functions */
+  lenv_add_builtin(e, "list",  builtin_list);
+  lenv_add_builtin(e, "head",  builtin_head);
+  lenv_add_builtin(e, "tail",  builtin_tail);
+  lenv_add_builtin(e, "eval",  builtin_eval);
+  lenv_add_builtin(e, "join",  builtin_join);
+
+  /* List Library, replacing the prelude's definitions */
+  lenv_add_builtin(e, "len",       builtin_len);
+  lenv_add_builtin(e, "nth",       builtin_nth);
+  lenv_add_builtin(e, "last",      builtin_last);
+  lenv_add_builtin(e, "take",      builtin_take);
+  lenv_add_builtin(e, "drop",      builtin_drop);
+  lenv_add_builtin(e, "elem",      builtin_elem);
+  lenv_add_builtin(e, "map",       builtin_map);
+  lenv_add_builtin(e, "filter",    builtin_filter);
+  lenv_add_builtin(e, "foldleft",  builtin_foldleft);
+  lenv_add_builtin(e, "foldright", builtin_foldright);
+  lenv_add_builtin(e, "sum",       builtin_sum);
+  lenv_add_builtin(e, "product",   builtin_product);
+
+  /* Mathematical Functions */
+  lenv_add_builtin(e, "+",     builtin_add);
+  lenv_add_builtin(e, "-",     builtin_sub);
+  lenv_add_builtin(e, "*",     builtin_mul);
+  lenv_add_builtin(e, "/",     builtin_div);
+
+  /* Vector Functions */
+  lenv_add_builtin(e, "vec",       builtin_vec);
+  lenv_add_builtin(e, "vec-range", builtin_vec_range);
+  lenv_add_builtin(e, "list->vec", builtin_list_vec);
+  lenv_add_builtin(e, "vec->list", builtin_vec_list);
+  lenv_add_builtin(e, "vec-len",   builtin_vec_len);
+  lenv_add_builtin(e, "vec-get",   builtin_vec_get);
+  lenv_add_builtin(e, "vec-slice", builtin_vec_slice);
+  lenv_add_builtin(e, "vec+",      builtin_vec_add);
+  lenv_add_builtin(e, "vec-",      builtin_vec_sub);
+  lenv_add_builtin(e, "vec*",      builtin_vec_mul);
+  lenv_add_builtin(e, "vec/",      builtin_vec_div);
+  lenv_add_builtin(e, "vec-sum",   builtin_vec_sum);
+  lenv_add_builtin(e, "vec-dot",   builtin_vec_dot);
+  lenv_add_builtin(e, "vec-min",   builtin_vec_min);
+  lenv_add_builtin(e, "vec-max",   builtin_vec_max);
+
+  /* String Functions */
+  lenv_add_builtin(e, "str-len",    builtin_str_len);
+  lenv_add_builtin(e, "str-concat", builtin_str_concat);
+  lenv_add_builtin(e, "str-slice",  builtin_str_slice);
+  lenv_add_builtin(e, "str-find",   builtin_str_find);
+  lenv_add_builtin(e, "str-split",  builtin_str_split);
+  lenv_add_builtin(e, "str-join",   builtin_str_join);
+  lenv_add_builtin(e, "str->num",   builtin_str_num);
+  lenv_add_builtin(e, "num->str",   builtin_num_str);
+
+  /* Map Functions */
+  lenv_add_builtin(e, "dict",        builtin_dict);
+  lenv_add_builtin(e, "dict-get",    builtin_dict_get);
+  lenv_add_builtin(e, "dict-has",    builtin_dict_has);
+  lenv_add_builtin(e, "dict-put",    builtin_dict_put);
+  lenv_add_builtin(e, "dict-del",    builtin_dict_del);
+  lenv_add_builtin(e, "dict-size",   builtin_dict_size);
+  lenv_add_builtin(e, "dict-keys",   builtin_dict_keys);
+  lenv_add_builtin(e, "dict-values", builtin_dict_values);
+
+  /* Variable Functions */
+  lenv_add_builtin(e, "\\",    builtin_lambda);
+  lenv_add_builtin(e, "doh",   builtin_def);
+  lenv_add_builtin(e, "=",     builtin_put);
+  lenv_add_builtin(e, "defined", builtin_defined);
+
+  /* Comparison Functions */
+  lenv_add_builtin(e, ">",     builtin_gt);
+  lenv_add_builtin(e, "<",     builtin_lt);
+  lenv_add_builtin(e, ">=",    builtin_ge);
+  lenv_add_builtin(e, "<=",    builtin_le);
+  lenv_add_builtin(e, "==",    builtin_eq);
+  lenv_add_builtin(e, "!=",    builtin_ne);
+  lenv_add_builtin(e, "if",    builtin_if);
+
+  /* String Functions */
+  lenv_add_builtin(e, "load",  builtin_load);
+  lenv_add_builtin(e, "error", builtin_error);
+  lenv_add_builtin(e, "print", builtin_print);
+  lenv_add_builtin(e, "show",  builtin_show);
+
+  /* Memory Functions */
+  lenv_add_builtin(e, "gc-stats", builtin_gc_stats);
+  lenv_add_builtin(e, "gc-tune",  builtin_gc_tune);
+  lenv_add_builtin(e, "mem-stats", builtin_mem_stats);
+
+  /* Memoization Functions */
+  lenv_add_builtin(e, "memo",       builtin_memo);
+  lenv_add_builtin(e, "memo-stats", builtin_memo_stats);
+
+  /* Profiling Functions */
+  lenv_add_builtin(e, "profile", builtin_profile);
+
+  /* Parallel Functions */
+  lenv_add_builtin(e, "pmap",    builtin_pmap);
+  lenv_add_builtin(e, "preduce", builtin_preduce);
+  lenv_add_builtin(e, "threads", builtin_threads);
+}
+
+/* Evaluation */
+/* Bind the arguments a to the formals of the function f, consuming a. Once */
+/* every formal is bound the new frame is left in *env and NULL returned, */
+/* otherwise the partially applied function or an error is returned. */
+static lval* lval_bind_args(lval* f, lval* a, lenv** env) {
+
+  /* Record Argument Counts */
+  int given = a->count;
+  int total = f->formals->count;
+
+  /* Bind into a new frame that starts with any partially applied arguments */
+  lenv* frame = lenv_copy(f->env);
+  int i = 0; // next formal
+  int j = 0; // next argument
+
+  /* While arguments still remain to be processed */
+  while (j < a->count) {
+
+    /* If we've ran out of formal arguments to bind */
+    if (i == total) {
+      lenv_del(frame); lval_del(a);
+      return lval_err("Function passed too many arguments? Got %i when you expected %i? Well eat my shorts!", given, total);
+    }
+
+    /* Take the next symbol from the formals */
+    lval* sym = f->formals->cell[i++];
+
+    /* Special Case to deal with '&' */
+    if (strcmp(sym->sym, "&") == 0) {
+
+      /* Ensure '&' is followed by another symbol */
+      if (total - i != 1) {
+        lenv_del(frame); lval_del(a);
+        return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
+      }
+
+      /* Next formal should be bound to remaining arguments */
+      lval* rest = lval_qexpr();
+      while (j < a->count) { rest = lval_add(rest, lval_copy(a->cell[j++])); }
+      lenv_bind(frame, f->formals->cell[i++], rest);
+      break;
+    }
+
+    /* Bind the next argument into the new environment */
+    lenv_bind(frame, sym, lval_copy(a->cell[j++]));
+  }
+
+  /* Argument list is now bound so can be cleaned up */
+  lval_del(a);
+
+  /* If '&' remains in formal list then bind to empty list */
+  if (i < total && strcmp(f->formals->cell[i]->sym, "&") == 0) {
+
+    /* Check to ensure that & is not passed invalidly. */
+    if (total - i != 2) {
+      lenv_del(frame);
+      return lval_err("Function format invalid. Symbol '&' not followed by single symbol. Blame stupid Flanders.");
+    }
+
+    /* Bind the symbol after '&' to an empty list */
+    lenv_bind(frame, f->formals->cell[i+1], lval_qexpr());
+    i += 2;
+  }
+
+  /* If all formals have been bound then the frame is ready */
+  if (i == total) {
+    *env = frame;
+    return NULL;
+  }
+
+  /* Otherwise return partially evaluated function, sharing the formals still to bind */
+  lval* p = lval_builtin(NULL);
+  p->env = frame;
+  p->formals = lval_qexpr();
+  while (i < total) { p->formals = lval_add(p->formals, lval_copy(f->formals->cell[i++])); }
+  p->body = lval_copy(f->body);
+  p->name = f->name;
+  return p;
+}
+
+/* Rebind the frame e in place for a call of f with the arguments a, if the */
+/* call binds exactly the symbols e holds, in the same slots. Consumes a on success. */
+static int lenv_rebind(lenv* e, lval* f, lval* a) {
+  if (f->env->count || a->count != f->formals->count || e->count != a->count) { return 0; }
+  for (int i = 0; i < a->count; i++) {
+    if (e->syms[i] != f->formals->cell[i]->sym) { return 0; }
+  }
+
+  /* Move the arguments into the frame, replacing the old values */
+  for (int i = 0; i < a->count; i++) {
+    lval_del(e->vals[i]);
+    e->vals[i] = a->cell[i];
+    a->cell[i] = lval_num(0);
+  }
+  lval_del(a);
+  return 1;
+}
+
+/* True if every symbol bound in e is bound somewhere in the chain from n */
+static int lenv_hidden(lenv* n, lenv* e) {
+  for (int i = 0; i < e->count; i++) {
+    unsigned long bit = lenv_filter_bit(e->syms[i]);
+    lenv* k = n;
+    while (k && !((k->filter & bit) && lenv_find(k, e->syms[i]) >= 0)) { k = k->par; }
+    if (!k) { return 0; }
+  }
+  return 1;
+}
+
+/* Parent the new frame n to the frames from e up to base, deleting any of */
+/* them that the frames below can no longer let a lookup reach */
+static void lenv_link(lenv* n, lenv* e, lenv* base) {
+  lenv* last = n;
+  n->par = NULL;
+  while (e != base) {
+    lenv* par = e->par;
+    if (lenv_hidden(n, e)) {
+      lenv_del(e);
+    } else {
+      last->par = e;
+      e->par = NULL;
+      last = e;
+    }
+    e = par;
+  }
+  last->par = base;
+}
+
+lval* lval_call(lenv* e, lval* f, lval* a) {
+
+  /* If Builtin then simply call that */
+  if (f->builtin) { return lprof_on ? lprof_builtin(e, f, a) : f->builtin(e, a); }
+  if (lval_is_memo(f)) { return lmemo_call(e, f, a); }
+
+  lenv* env;
+  lval* p = lval_bind_args(f, a, &env);
+  if (p) { return p; }
+
+  /* Set environment parent to evaluation environment, then evaluate the */
+  /* body as an S-Expression in a loop that owns the new frame */
+  env->par = e;
+  if (!lprof_on) { return lval_eval_loop(e, env, lval_copy(f->body)); }
+
+  lprof_enter(f);
+  lval* r = lval_eval_loop(e, env, lval_copy(f->body));
+  lprof_leave();
+  return r;
+}
+
+/* Bytecode */
+/* A list that is evaluated while shared, such as a function body or the */
+/* branches of an if, is compiled once into bytecode kept on the list. Nested */
+/* S-Expressions are compiled inline, so the VM evaluates the whole tree */
+/* without recursing or copying it, leaving only calls to recurse. */
+/* Symbols are still looked up when the code runs, since any frame can rebind */
+/* them, but they go through the slot the resolver gave them first. */
+/* The outermost application is left to the caller as a tail call. */
+enum { OP_CONST, OP_LOAD, OP_APPLY, OP_TAIL };
+
+struct lcode {
+  int* ops; // opcode and operand pairs
+  int ops_count;
+  int ops_cap;
+
+  /* Constant pool, holding a reference to each literal and symbol */
+  lval** consts;
+  int consts_count;
+  int consts_cap;
+
+  /* Value stack needed to run */
+  int depth;
+  int max_depth;
+};
+
+void lcode_del(lcode* c) {
+  for (int i = 0; i < c->consts_count; i++) { lval_del(c->consts[i]); }
+  free(c->consts);
+  free(c->ops);
+  free(c);
+}
+
+static void lcode_emit(lcode* c, int op, int arg, int effect) {
+  if (c->ops_count + 2 > c->ops_cap) {
+    c->ops_cap = c->ops_cap ? c->ops_cap * 2 : 16;
+    c->ops = realloc(c->ops, sizeof(int) * c->ops_cap);
+  }
+  c->ops[c->ops_count++] = op;
+  c->ops[c->ops_count++] = arg;
+
+  /* Track how deep the value stack gets */
+  c->depth += effect;
+  if (c->depth > c->max_depth) { c->max_depth = c->depth; }
+}
+
+static int lcode_const(lcode* c, lval* v) {
+  if (c->consts_count == c->consts_cap) {
+    c->consts_cap = c->consts_cap ? c->consts_cap * 2 : 8;
+    c->consts = realloc(c->consts, sizeof(lval*) * c->consts_cap);
+  }
+  c->consts[c->consts_count] = lval_copy(v);
+  return c->consts_count++;
+}
+
+/* Emit code leaving the value of the S-Expression v on the stack */
+static void lcode_compile_sexpr(lcode* c, lval* v) {
+  for (int i = 0; i < v->count; i++) {
+    lval* x = v->cell[i];
+    switch (lval_type(x)) {
+      case LVAL_SYM:   lcode_emit(c, OP_LOAD, lcode_const(c, x), 1); break;
+      case LVAL_SEXPR: lcode_compile_sexpr(c, x); break;
+      default:         lcode_emit(c, OP_CONST, lcode_const(c, x), 1); break;
+    }
+  }
+  lcode_emit(c, OP_APPLY, v->count, 1 - v->count);
+}
+
+lcode* lcode_compile(lval* v) {
+  lcode* c = calloc(1, sizeof(lcode));
+  lcode_compile_sexpr(c, v);
+
+  /* Turn the last application into the tail call */
+  c->ops[c->ops_count-2] = OP_TAIL;
+  return c;
+}
+
+/* Check the n values on top of the stack as an S-Expression would. If they */
+/* are a call, *f is set to the function and the arguments are returned, */
+/* otherwise *f is set to NULL and the value they stand for is returned. */
+static lval* lvm_call_args(lval** base, int n, lval** f) {
+  *f = NULL;
+
+  /* Error Checking, the first error wins */
+  for (int i = 0; i < n; i++) {
+    if (lval_type(base[i]) == LVAL_ERR) {
+      lval* err = base[i];
+      for (int j = 0; j < n; j++) { if (j != i) { lval_del(base[j]); } }
+      return err;
+    }
+  }
+
+  /* Empty Expression */
+  if (n == 0) { return lval_sexpr(); }
+
+  /* Single Expression. Return it directly */
+  if (n == 1) { return base[0]; }
+
+  /* Ensure first element is a Function */
+  if (lval_type(base[0]) != LVAL_FUN) {
+    lval* err = lval_err(
+      "S-Expression starts with incorrect type. "
+          "Got %s, Expected %s. Don't blame me, I voted for Haskell.",
+           ltype_name(lval_type(base[0])), ltype_name(LVAL_FUN));
+    for (int j = 0; j < n; j++) { lval_del(base[j]); }
+    return err;
+  }
+
+  /* Move the arguments into a new S-Expression */
+  lval* a = lval_sexpr();
+  if (n > 1) {
+    a->cells = lcells_new(n-1);
+    a->cells->used = a->count = n-1;
+    a->cell = a->cells->items;
+    memcpy(a->cell, base+1, sizeof(lval*) * a->count);
+  }
+  *f = base[0];
+  return a;
+}
+
+/* Apply the n values on top of the stack, leaving the result in their place */
+static lval* lvm_apply(lenv* e, lval** base, int n) {
+  lval* f;
+  lval* a = lvm_call_args(base, n, &f);
+  if (!f) { return a; }
+
+  lval* result = lval_call(e, f, a);
+  lval_del(f);
+  return result;
+}
+
+/* Computed goto dispatch where the compiler supports it, a switch otherwise */
+#if defined(__GNUC__) && !defined(SNEED_NO_COMPUTED_GOTO)
+#define LVM_COMPUTED_GOTO
+#endif
+
+/* Run c, returning its tail call as lvm_call_args does */
+lval* lvm_run(lenv* e, lcode* c, lval** f) {
+  lval* small[32];
+  lval** stack = c->max_depth <= 32 ? small : malloc(sizeof(lval*) * c->max_depth);
+  lval** sp = stack;
+  int* ip = c->ops;
+  lval* result;
+
+#ifdef LVM_COMPUTED_GOTO
+  static void* labels[] = { &&lvm_OP_CONST, &&lvm_OP_LOAD, &&lvm_OP_APPLY, &&lvm_OP_TAIL };
+  #define LVM_OP(op) lvm_##op
+  #define LVM_DISPATCH() goto *labels[ip[0]]
+#else
+  #define LVM_OP(op) case op
+  #define LVM_DISPATCH() goto lvm_dispatch
+#endif
+
+  LVM_DISPATCH();
+
+#ifndef LVM_COMPUTED_GOTO
+lvm_dispatch:
+  switch (ip[0]) {
+#endif
+
+  LVM_OP(OP_CONST):
+    *sp++ = lval_copy(c->consts[ip[1]]);
+    ip += 2;
+    LVM_DISPATCH();
+
+  LVM_OP(OP_LOAD):
+    *sp++ = lenv_get(e, c->consts[ip[1]]);
+    ip += 2;
+    LVM_DISPATCH();
+
+  LVM_OP(OP_APPLY):
+    sp -= ip[1];
+    *sp = lvm_apply(e, sp, ip[1]);
+    sp++;
+    ip += 2;
+    LVM_DISPATCH();
+
+  LVM_OP(OP_TAIL):
+    result = lvm_call_args(sp - ip[1], ip[1], f);
+
+#ifndef LVM_COMPUTED_GOTO
+  }
+#endif
+
+  #undef LVM_OP
+  #undef LVM_DISPATCH
+
+  if (stack != small) { free(stack); }
+  return result;
+}
+
+/* Evaluate the elements of an S-Expression, returning its tail call as */
+/* lvm_call_args does */
+lval* lval_eval_sexpr(lenv* e, lval* v, lval** f) {
+  *f = NULL;
+
+  /* Children are replaced by their values, so work on an unshared list */
+  v = lval_mut(v);
+
+  /* Evaluate Children */
+  for (int i = 0; i < v->count; i++) {
+    v->cell[i] = lval_eval(e, v->cell[i]); // recursively evaluate each child lval to handle nested expressions
+  }
+
+  /* Error Checking */
+  for (int i = 0; i < v->count; i++) {
+    if (lval_type(v->cell[i]) == LVAL_ERR) { return lval_take(v, i); }
+  }
+
+  /* Empty Expression. Return as it is */
+  if (v->count == 0) { return v; }
+
+  /* Single Expression. Return it directly */
+  if (v->count == 1) { return lval_take(v, 0); }
+
+  /* Ensure first element is a Function after Evaluation */
+  if (lval_type(v->cell[0]) != LVAL_FUN) {
+    lval* err = lval_err(
+      "S-Expression starts with incorrect type. "
+          "Got %s, Expected %s. Don't blame me, I voted for Haskell.",
+           ltype_name(lval_type(v->cell[0])), ltype_name(LVAL_FUN));
+           lval_del(v);
+           return err;
+    }
+
+  /* If so, leave the call to the caller */
+  *f = lval_pop(v, 0);
+  return v;
+}
+
+/* Evaluate v as an S-Expression in e. Calls in tail position, including the */
+/* branches of if and the argument to eval, continue this loop rather than */
+/* recursing, so tail recursive functions run in constant C stack. The frames */
+/* from e up to base belong to the loop and are deleted when it finishes. */
+lval* lval_eval_loop(lenv* base, lenv* e, lval* v) {
+  lval* result;
+  int profiled = 0; // whether the profiler has a frame of ours
+
+  for (;;) {
+
+    /* An S-Expression alone in a list is in tail position too, as with */
+    /* the (x) that first and second leave to eval */
+    while (v->count == 1 && lval_type(v->cell[0]) == LVAL_SEXPR) { v = lval_take(v, 0); }
+
+    /* Evaluate everything but the tail call. Lists that are shared are */
+    /* likely to be evaluated again, so they are compiled and the code kept. */
+    lval* f;
+    lval* a;
+    if (v->refs > 1 || v->code) {
+      if (!v->code) { v->code = lcode_compile(v); }
+      a = lvm_run(e, v->code, &f);
+      lval_del(v);
+    } else {
+      lval_retype(v, LVAL_SEXPR);
+      a = lval_eval_sexpr(e, v, &f);
+    }
+
+    /* Not a call, so that is the value */
+    if (!f) { result = a; break; }
+
+    /* If and eval continue with the list they would evaluate */
+    if (f->builtin == builtin_if || f->builtin == builtin_eval) {
+      v = f->builtin == builtin_if ? lval_if_branch(a) : lval_eval_arg(a);
+      lval_del(f);
+      if (lval_type(v) == LVAL_ERR) { result = v; break; }
+      continue;
+    }
+
+    /* Other builtins return their value, as do memoized functions */
+    if (f->builtin) {
+      result = lprof_on ? lprof_builtin(e, f, a) : f->builtin(e, a);
+      lval_del(f);
+      break;
+    }
+    if (lval_is_memo(f)) {
+      result = lmemo_call(e, f, a);
+      lval_del(f);
+      break;
+    }
+
+    /* A self tail call rebinds the current frame in place */
+    if (e != base && lenv_rebind(e, f, a)) {
+      if (lprof_on) { lprof_tail(f, &profiled); }
+      v = lval_copy(f->body);
+      lval_del(f);
+      continue;
+    }
+
+    /* Otherwise bind a new frame, stopping at a partial application */
+    lenv* env;
+    lval* p = lval_bind_args(f, a, &env);
+    if (p) { lval_del(f); result = p; break; }
+
+    /* Frames of ours that the new one hides are dropped */
+    lenv_link(env, e, base);
+    e = env;
+    if (lprof_on) { lprof_tail(f, &profiled); }
+    v = lval_copy(f->body);
+    lval_del(f);
+  }
+
+  if (profiled) { lprof_leave(); }
+
+  /* Delete the frames this loop created */
+  while (e != base) {
+    lenv* par = e->par;
+    lenv_del(e);
+    e = par;
+  }
+  return result;
+}
+
+/* Evaluate a Q-Expression or S-Expression as an S-Expression */
+lval* lval_eval_list(lenv* e, lval* v) {
+  return lval_eval_loop(e, e, v);
+}
+
+/* Evaluate an lval */
+lval* lval_eval(lenv* e, lval* v) {
+  if (lval_type(v) == LVAL_SYM) { // if it's a symbol, we need to look it up in the environment
+    lval* x = lenv_get(e, v);
+    lval_del(v);
+    return x;
+  }
+  if (lval_type(v) == LVAL_SEXPR) { return lval_eval_list(e, v); } // if it's a sexpr, we need to evaluate it
+  // everything else is a no-op
+  return v;
+}
+
+/* Reader */
+/* Source text is read straight into lvals in a single pass, with no syntax */
+/* tree in between. Symbols are interned and numbers parsed from the input */
+/* in place, and strings are unescaped into their final allocation. The */
+/* syntax is: */
+/*   number  : -?[0-9]+ */
+/*   symbol  : [a-zA-Z0-9_+\-*\/\\=<>!&]+ */
+/*   string  : "(\\.|[^"])*" */
+/*   comment : ;[^\r\n]* */
+/*   sexpr   : '(' expr* ')' */
+/*   qexpr   : '{' expr* '}' */
+/* with a number taking priority over a symbol where both could match. */
+typedef struct {
+  char* name;  // where the input came from, for error messages
+  char* start;
+  char* s;     // next character to read
+  lval* err;   // set on a syntax error
+} lreader;
+
+static int lread_is_sym(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+    || (c && strchr("_+-*/\\=<>!&", c));
+}
+
+/* Record a syntax error at the current position, returning NULL */
+static lval* lread_error(lreader* r, char* msg) {
+  int line = 1;
+  char* bol = r->start;
+  for (char* c = r->start; c < r->s; c++) {
+    if (*c == '\n') { line++; bol = c+1; }
+  }
+  r->err = lval_err("%s:%i:%i: %s", r->name, line, (int)(r->s - bol) + 1, msg);
+  return NULL;
+}
+
+/* Skip whitespace and comments */
+static void lread_skip(lreader* r) {
+  for (;;) {
+    switch (*r->s) {
+      case ' ': case '\t': case '\n': case '\r': case '\f': case '\v':
+        r->s++;
+        break;
+      case ';':
+        while (*r->s && *r->s != '\n' && *r->s != '\r') { r->s++; }
+        break;
+      default:
+        return;
+    }
+  }
+}
+
+static lval* lread_num(lreader* r) {
+  int neg = *r->s == '-';
+  if (neg) { r->s++; }
+
+  /* Accumulate the magnitude, noting if it leaves the range of a long */
+  unsigned long limit = neg ? (unsigned long)LONG_MAX + 1 : (unsigned long)LONG_MAX;
+  unsigned long x = 0;
+  int overflow = 0;
+  while (*r->s >= '0' && *r->s <= '9') {
+    unsigned long d = *r->s++ - '0';
+    if (x > (limit - d) / 10) { overflow = 1; }
+    x = x * 10 + d;
+  }
+
+  if (overflow) { return lval_err("Invalid number! Smithers! Release the hounds!"); }
+  return lval_num(neg ? -(long)(x - 1) - 1 : (long)x);
+}
+
+static lval* lread_str(lreader* r) {
+
+  /* Find the closing quote first, so the string can be allocated once */
+  char* end = r->s + 1;
+  while (*end && *end != '"') {
+    if (*end == '\\' && end[1]) { end++; }
+    end++;
+  }
+  if (!*end) { return lread_error(r, "unterminated string"); }
+  r->s++;
+
+  /* Unescape into the new string */
+  lval* v = lval_str_len(NULL, end - r->s);
+  char* o = v->str;
+  while (r->s < end) {
+    char c = *r->s++;
+    if (c != '\\') { *o++ = c; continue; }
+    switch (c = *r->s++) {
+      case 'a':  *o++ = '\a'; break;
+      case 'b':  *o++ = '\b'; break;
+      case 'f':  *o++ = '\f'; break;
+      case 'n':  *o++ = '\n'; break;
+      case 'r':  *o++ = '\r'; break;
+      case 't':  *o++ = '\t'; break;
+      case 'v':  *o++ = '\v'; break;
+      case '0':  *o++ = '\0'; break;
+      case '\\': case '\'': case '"': *o++ = c; break;
+      default:   *o++ = '\\'; *o++ = c; // unknown escapes are kept as written
+    }
+  }
+  r->s = end + 1;
+
+  /* Escapes make it shorter than the room left for it */
+  v->size = v->chars->used = o - v->str;
+  *o = '\0';
+  return v;
+}
+
+static lval* lread_expr(lreader* r); // forward declaration
+
+/* Read the elements of a list up to its closing character into x */
+static lval* lread_list(lreader* r, lval* x, char close) {
+  r->s++;
+  for (;;) {
+    lread_skip(r);
+    if (*r->s == close) { r->s++; return x; }
+    if (!*r->s) {
+      lval_del(x);
+      return lread_error(r, close == ')' ? "expected ')' before end of input" : "expected '}' before end of input");
+    }
+
+    lval* y = lread_expr(r);
+    if (!y) { lval_del(x); return NULL; }
+    x = lval_add(x, y);
+  }
+}
+
+/* Read one expression, returning NULL on a syntax error */
+static lval* lread_expr(lreader* r) {
+  char c = *r->s;
+  if (c == '(') { return lread_list(r, lval_sexpr(), ')'); }
+  if (c == '{') { return lread_list(r, lval_qexpr(), '}'); }
+  if (c == '"') { return lread_str(r); }
+
+  /* Numbers are tried before symbols */
+  char* d = r->s + (c == '-');
+  if (*d >= '0' && *d <= '9') { return lread_num(r); }
+
+  if (lread_is_sym(c)) {
+    char* end = r->s;
+    while (lread_is_sym(*end)) { end++; }
+    lval* v = lval_alloc(LVAL_SYM);
+    v->sym = lsym_intern_n(r->s, end - r->s);
+    v->slot = -1;
+    r->s = end;
+    return v;
+  }
+
+  char msg[32];
+  snprintf(msg, sizeof(msg), "unexpected '%c'", c);
+  return lread_error(r, msg);
+}
+
+/* Read all of the null terminated input into an S-Expression, or an error */
+lval* lval_read(char* name, char* input) {
+  lreader r = { name, input, input, NULL };
+  lval* x = lval_sexpr();
+
+  for (;;) {
+    lread_skip(&r);
+    if (!*r.s) { return x; }
+
+    lval* y = lread_expr(&r);
+    if (!y) { lval_del(x); return r.err; }
+    x = lval_add(x, y);
+  }
+}
+
+lval* lcache_read(char* filename, char* input, long size); // forward declaration
+void lcache_write(char* filename, char* input, long size, lval* x); // forward declaration
+static int lcache_on;
+
+/* Read a whole file, as lval_read does */
+lval* lval_read_file(char* filename) {
+  FILE* f = fopen(filename, "rb");
+  if (!f) { return lval_err("Unable to open file '%s'", filename); }
+
+  /* Read the contents into one buffer, sized up front unless the file */
+  /* cannot seek, as with a pipe, which is read a piece at a time instead */
+  long size = -1;
+  if (fseek(f, 0, SEEK_END) == 0) { size = ftell(f); }
+  int seekable = size >= 0 && fseek(f, 0, SEEK_SET) == 0;
+  char* input;
+  if (seekable) {
+    input = malloc(size + 1);
+    size = input ? (long)fread(input, 1, size, f) : 0;
+  } else {
+    long cap = 4096;
+    input = malloc(cap);
+    size = 0;
+    size_t n;
+    while (input && (n = fread(input + size, 1, cap - size - 1, f)) > 0) {
+      size += n;
+      if (size + 1 == cap) {
+        char* grown = realloc(input, cap * 2);
+        if (!grown) { free(input); input = NULL; break; }
+        input = grown;
+        cap *= 2;
+      }
+    }
+  }
+  int failed = ferror(f);
+  fclose(f);
+  if (!input || failed) {
+    free(input);
+    return lval_err("Unable to read file '%s'", filename);
+  }
+  input[size] = '\0';
+
+  /* Use what was read last time if the file has not changed since. Only */
+  /* a file that can seek is cached, as a pipe reads differently each time. */
+  int cache = lcache_on && seekable;
+  lval* x = cache ? lcache_read(filename, input, size) : NULL;
+  if (!x) {
+    x = lval_read(filename, input);
+    if (cache && lval_type(x) != LVAL_ERR) { lcache_write(filename, input, size, x); }
+  }
+  free(input);
+  return x;
+}
+
+/* Heap Images */
+/* The global environment, once a prelude has been loaded into it, can be */
+/* written to an image file and read back at startup in place of loading */
+/* the prelude again. Every value is written out in full, symbols by name */
+/* with the slot the resolver gave them, so reading an image back neither */
+/* reads nor resolves any source and evaluates nothing. Builtins are written */
+/* by the name they were registered under, and memoized functions come back */
+/* with an empty cache. Values shared within the environment come back as */
+/* equal copies. An image is only meant to be read by the build that wrote */
+/* it, and is rejected if its version does not match. */
+#define LIMAGE_MAGIC "SNEEDIMG"
+#define LIMAGE_VERSION 2
+
+enum { LIMAGE_NUM, LIMAGE_SYM, LIMAGE_STR, LIMAGE_ERR, LIMAGE_VEC, LIMAGE_SEXPR,
+  LIMAGE_QEXPR, LIMAGE_BUILTIN, LIMAGE_LAMBDA, LIMAGE_MEMO, LIMAGE_MAP };
+
+/* The image being written, built up in memory */
+typedef struct {
+  char* data;
+  size_t len;
+  size_t cap;
+} limage_out;
+
+static void limage_put(limage_out* o, const void* p, size_t n) {
+  if (o->len + n > o->cap) {
+    o->cap = (o->len + n) * 2;
+    o->data = realloc(o->data, o->cap);
+  }
+  memcpy(o->data + o->len, p, n);
+  o->len += n;
+}
+
+static void limage_put_tag(limage_out* o, int tag) {
+  unsigned char t = tag;
+  limage_put(o, &t, 1);
+}
+
+static void limage_put_int(limage_out* o, int64_t x) { limage_put(o, &x, sizeof(x)); }
+
+/* Strings are written with their terminator so they can be used in place */
+/* when read back. NULL is written as a length of -1. */
+static void limage_put_text(limage_out* o, const char* s, size_t n) {
+  limage_put_int(o, n);
+  limage_put(o, s, n);
+  limage_put(o, "", 1);
+}
+
+static void limage_put_str(limage_out* o, char* s) {
+  if (!s) { limage_put_int(o, -1); return; }
+  limage_put_text(o, s, strlen(s));
+}
+
+static int limage_put_env(limage_out* o, lenv* e); // forward declaration
+
+/* Write v, returning 0 if it holds something that cannot be written */
+static int limage_put_val(limage_out* o, lval* v) {
+  switch (lval_type(v)) {
+    case LVAL_NUM:
+      limage_put_tag(o, LIMAGE_NUM);
+      limage_put_int(o, lval_to_num(v));
+      return 1;
+    case LVAL_SYM:
+      limage_put_tag(o, LIMAGE_SYM);
+      limage_put_str(o, v->sym);
+      limage_put_int(o, v->slot);
+      return 1;
+    case LVAL_STR:
+      limage_put_tag(o, LIMAGE_STR);
+      limage_put_text(o, v->str, v->size);
+      return 1;
+    case LVAL_ERR:
+      limage_put_tag(o, LIMAGE_ERR);
+      limage_put_str(o, v->err);
+      return 1;
+    case LVAL_VEC:
+      limage_put_tag(o, LIMAGE_VEC);
+      limage_put_int(o, v->len);
+      limage_put(o, v->data, sizeof(int64_t) * v->len);
+      return 1;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      limage_put_tag(o, lval_type(v) == LVAL_SEXPR ? LIMAGE_SEXPR : LIMAGE_QEXPR);
+      limage_put_int(o, v->count);
+      for (int i = 0; i < v->count; i++) {
+        if (!limage_put_val(o, v->cell[i])) { return 0; }
+      }
+      return 1;
+
+    /* Maps are written as their live keys and values, and built up again */
+    case LVAL_MAP:
+      limage_put_tag(o, LIMAGE_MAP);
+      limage_put_int(o, v->keys);
+      for (int i = 0; i < v->upto; i++) {
+        if (!lmap_live(v, i)) { continue; }
+        if (!limage_put_val(o, v->map->entries[i].key)
+          || !limage_put_val(o, v->map->entries[i].val)) { return 0; }
+      }
+      return 1;
+    case LVAL_FUN:
+      if (lval_is_memo(v)) {
+        limage_put_tag(o, LIMAGE_MEMO);
+        limage_put_str(o, v->name);
+        limage_put_int(o, v->memo->capacity);
+        return limage_put_val(o, v->memo->fn);
+      }
+      if (v->builtin) {
+        if (!v->name) { return 0; }
+        limage_put_tag(o, LIMAGE_BUILTIN);
+        limage_put_str(o, v->name);
+        return 1;
+      }
+      limage_put_tag(o, LIMAGE_LAMBDA);
+      limage_put_str(o, v->name);
+      return limage_put_env(o, v->env) && limage_put_val(o, v->formals) && limage_put_val(o, v->body);
+  }
+  return 0;
+}
+
+static int limage_put_env(limage_out* o, lenv* e) {
+  limage_put_int(o, e->count);
+  for (int i = 0; i < e->count; i++) {
+    limage_put_str(o, e->syms[i]);
+    if (!limage_put_val(o, e->vals[i])) { return 0; }
+  }
+  return 1;
+}
+
+/* Write the global environment e to the named file */
+lval* limage_write(lenv* e, char* filename) {
+  limage_out o = { NULL, 0, 0 };
+  limage_put(&o, LIMAGE_MAGIC, 8);
+  limage_put_int(&o, LIMAGE_VERSION);
+
+  /* Builtins still bound to their own names are there from the start */
+  int count = 0;
+  for (int i = 0; i < e->count; i++) {
+    lval* v = e->vals[i];
+    if (!(lval_type(v) == LVAL_FUN && v->builtin && v->name == e->syms[i])) { count++; }
+  }
+  limage_put_int(&o, count);
+  for (int i = 0; i < e->count; i++) {
+    lval* v = e->vals[i];
+    if (lval_type(v) == LVAL_FUN && v->builtin && v->name == e->syms[i]) { continue; }
+    limage_put_str(&o, e->syms[i]);
+    if (!limage_put_val(&o, v)) {
+      free(o.data);
+      return lval_err("Cannot write '%s' to an image. Ah, sweet manatee of Galilee!", e->syms[i]);
+    }
+  }
+
+  FILE* f = fopen(filename, "wb");
+  int ok = f && fwrite(o.data, 1, o.len, f) == o.len;
+  if (f && fclose(f) != 0) { ok = 0; }
+  free(o.data);
+  if (!ok) { return lval_err("Unable to write image '%s'", filename); }
+  return lval_sexpr();
+}
+
+/* The image being read, with the environment holding every builtin by its */
+/* own name to look builtins up in */
+typedef struct {
+  char* s;
+  char* end;
+  lenv* builtins;
+} limage_in;
+
+static int limage_get(limage_in* in, void* p, size_t n) {
+  if ((size_t)(in->end - in->s) < n) { return 0; }
+  memcpy(p, in->s, n);
+  in->s += n;
+  return 1;
+}
+
+static int limage_get_int(limage_in* in, int64_t* x) { return limage_get(in, x, sizeof(*x)); }
+
+/* Read a string and its length in place, setting *s to NULL for a NULL string */
+static int limage_get_text(limage_in* in, char** s, int64_t* n) {
+  if (!limage_get_int(in, n)) { return 0; }
+  if (*n == -1) { *s = NULL; return 1; }
+  if (*n < 0 || *n >= in->end - in->s || in->s[*n] != '\0') { return 0; }
+  *s = in->s;
+  in->s += *n + 1;
+  return 1;
+}
+
+static int limage_get_str(limage_in* in, char** s) {
+  int64_t n;
+  return limage_get_text(in, s, &n);
+}
+
+/* Read a string that must be there as an interned symbol */
+static int limage_get_sym(limage_in* in, char** s) {
+  if (!limage_get_str(in, s) || !*s) { return 0; }
+  *s = lsym_intern(*s);
+  return 1;
+}
+
+/* Read a name, which may be NULL */
+static int limage_get_name(limage_in* in, char** s) {
+  if (!limage_get_str(in, s)) { return 0; }
+  if (*s) { *s = lsym_intern(*s); }
+  return 1;
+}
+
+static int limage_get_env(limage_in* in, lenv* e); // forward declaration
+
+/* Read a value, returning NULL if the image is corrupt */
+static lval* limage_get_val(limage_in* in) {
+  unsigned char tag;
+  int64_t x;
+  char* s;
+  if (!limage_get(in, &tag, 1)) { return NULL; }
+
+  switch (tag) {
+    case LIMAGE_NUM:
+      return limage_get_int(in, &x) ? lval_num(x) : NULL;
+    case LIMAGE_SYM: {
+      if (!limage_get_sym(in, &s) || !limage_get_int(in, &x)) { return NULL; }
+      lval* v = lval_alloc(LVAL_SYM);
+      v->sym = s;
+      v->slot = x;
+      return v;
+    }
+    case LIMAGE_STR:
+      return limage_get_text(in, &s, &x) && s ? lval_str_len(s, x) : NULL;
+    case LIMAGE_ERR:
+      return limage_get_str(in, &s) && s ? lval_err("%s", s) : NULL;
+    case LIMAGE_VEC: {
+      if (!limage_get_int(in, &x) || x < 0 || (uint64_t)x > (size_t)(in->end - in->s) / sizeof(int64_t)) { return NULL; }
+      lval* v = lval_vec(x);
+      if (!v) { return NULL; }
+      limage_get(in, v->data, sizeof(int64_t) * x);
+      return v;
+    }
+    case LIMAGE_SEXPR:
+    case LIMAGE_QEXPR: {
+      if (!limage_get_int(in, &x) || x < 0 || x > INT_MAX) { return NULL; }
+      lval* v = tag == LIMAGE_SEXPR ? lval_sexpr() : lval_qexpr();
+      while (x--) {
+        lval* y = limage_get_val(in);
+        if (!y) { lval_del(v); return NULL; }
+        v = lval_add(v, y);
+      }
+      return v;
+    }
+    case LIMAGE_MAP: {
+      if (!limage_get_int(in, &x) || x < 0 || x > INT_MAX) { return NULL; }
+      lval* v = lval_map();
+      while (x--) {
+        lval* k = limage_get_val(in);
+        lval* y = k ? limage_get_val(in) : NULL;
+        int t = k ? lval_type(k) : LVAL_ERR;
+        if (!y || (t != LVAL_NUM && t != LVAL_STR && t != LVAL_SYM)) {
+          if (k) { lval_del(k); }
+          if (y) { lval_del(y); }
+          lval_del(v);
+          return NULL;
+        }
+        v = lval_map_set(v, k, y);
+      }
+      return v;
+    }
+    case LIMAGE_BUILTIN: {
+      if (!limage_get_sym(in, &s)) { return NULL; }
+      int i = lenv_find(in->builtins, s);
+      return i < 0 ? NULL : lval_copy(in->builtins->vals[i]);
+    }
+    case LIMAGE_LAMBDA: {
+      if (!limage_get_name(in, &s)) { return NULL; }
+      lenv* env = lenv_new();
+      if (!limage_get_env(in, env)) { lenv_del(env); return NULL; }
+      lval* formals = limage_get_val(in);
+      lval* body = formals ? limage_get_val(in) : NULL;
+      if (!body || lval_type(formals) != LVAL_QEXPR || lval_type(body) != LVAL_QEXPR) {
+        lenv_del(env);
+        if (formals) { lval_del(formals); }
+        if (body) { lval_del(body); }
+        return NULL;
+      }
+      lval* v = lval_alloc(LVAL_FUN);
+      v->builtin = NULL;
+      v->env = env;
+      v->formals = formals;
+      v->body = body;
+      v->name = s;
+      return v;
+    }
+    case LIMAGE_MEMO: {
+      if (!limage_get_name(in, &s) || !limage_get_int(in, &x) || x <= 0) { return NULL; }
+      lval* fn = limage_get_val(in);
+      if (!fn) { return NULL; }
+      if (lval_type(fn) != LVAL_FUN) { lval_del(fn); return NULL; }
+      lval* v = lval_memo(fn, x);
+      v->name = s;
+      return v;
+    }
+  }
+  return NULL;
+}
+
+/* Read bindings into e, returning 0 if the image is corrupt */
+static int limage_get_env(limage_in* in, lenv* e) {
+  int64_t count;
+  if (!limage_get_int(in, &count) || count < 0) { return 0; }
+  while (count--) {
+    char* s;
+    if (!limage_get_sym(in, &s)) { return 0; }
+    lval* v = limage_get_val(in);
+    if (!v) { return 0; }
+
+    lval* k = lval_alloc(LVAL_SYM);
+    k->sym = s;
+    k->slot = -1;
+    lenv_put(e, k, v);
+    lval_del(k);
+    lval_del(v);
+  }
+  return 1;
+}
+
+/* Read the image in the named file into the global environment e */
+lval* limage_read(lenv* e, char* filename) {
+  FILE* f = fopen(filename, "rb");
+  if (!f) { return lval_err("Unable to open image '%s'", filename); }
+
+  /* Read the contents into one buffer */
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char* data = malloc(size > 0 ? size : 1);
+  size = size > 0 ? (long)fread(data, 1, size, f) : 0;
+  fclose(f);
+
+  limage_in in = { data, data + size, lenv_new() };
+  lenv_add_builtins(in.builtins);
+
+  char magic[8];
+  int64_t version;
+  lval* r;
+  if (!limage_get(&in, magic, 8) || memcmp(magic, LIMAGE_MAGIC, 8) != 0
+      || !limage_get_int(&in, &version) || version != LIMAGE_VERSION) {
+    r = lval_err("'%s' is not an image this Sneed can read. Worst. Image. Ever.", filename);
+  } else if (!limage_get_env(&in, e) || in.s != in.end) {
+    r = lval_err("Image '%s' is corrupt. Worst. Image. Ever.", filename);
+  } else {
+    r = lval_sexpr();
+  }
+
+  lenv_del(in.builtins);
+  free(data);
+  return r;
+}
+
+/* Load Cache */
+/* load keeps what it reads from each file in a cache file next to it, named */
+/* after the file with a "c" on the end, as prelude.sndc for prelude.snd. The */
+/* cache holds the file read into values, with each symbol named once in a */
+/* table at the start, numbers as variable length integers and lists with */
+/* their length first so they are built at their final size, and a literal */
+/* the reader could not make sense of as the error it read as. It is keyed */
+/* on a hash of the source and the build of the interpreter that wrote it, and */
+/* is ignored (and rewritten) whenever either differs, it is corrupt or it */
+/* cannot be read, so loading always gives what reading the source would. */
+/* Caches are written to a temporary file and renamed into place. */
+#define LCACHE_MAGIC "SNEEDLDC"
+#define LCACHE_VERSION 2
+#define LCACHE_BUILD __DATE__ " " __TIME__
+
+enum { LCACHE_NUM, LCACHE_SYM, LCACHE_STR, LCACHE_SEXPR, LCACHE_QEXPR, LCACHE_ERR };
+
+static int lcache_on = 1;
+static _Thread_local char lcache_thread; // its address tells this process's threads apart
+
+/* Hash n bytes a word at a time, as checking the source and the cache */
+/* byte by byte would cost much of the time the cache saves */
+static uint64_t lcache_hash(char* s, size_t n) {
+  uint64_t h = 14695981039346656037ULL;
+  uint64_t w;
+  for (; n >= 8; s += 8, n -= 8) {
+    memcpy(&w, s, 8);
+    h = (h ^ w) * 1099511628211ULL;
+    h ^= h >> 29;
+  }
+  w = 0;
+  memcpy(&w, s, n);
+  return ((h ^ w ^ n) * 1099511628211ULL) ^ (h >> 32);
+}
+
+static void lcache_put_uint(limage_out* o, uint64_t x) {
+  unsigned char b[10];
+  int n = 0;
+  while (x >= 128) { b[n++] = (x & 127) | 128; x >>= 7; }
+  b[n++] = x;
+  limage_put(o, b, n);
+}
 
-  /* Print each argument followed by a space */
-  for (int i = 0; i < a->count; i++) {
-    lval_println(a->cell[i]); putchar(' ');
+static void lcache_put_text(limage_out* o, const char* s, size_t n) {
+  lcache_put_uint(o, n);
+  limage_put(o, s, n);
+}
+
+static void lcache_put_chars(limage_out* o, char* s) { lcache_put_text(o, s, strlen(s)); }
+
+/* Symbols seen so far by the writer, by interned pointer */
+typedef struct {
+  char** syms;
+  int* slots;  // index+1 into syms, 0 if empty
+  int count;
+  int cap;     // of slots, a power of two
+} lcache_syms;
+
+static int lcache_sym_index(lcache_syms* t, char* sym) {
+  if (t->count * 2 >= t->cap) {
+    int ncap = t->cap ? t->cap * 2 : 256;
+    free(t->slots);
+    t->slots = calloc(ncap, sizeof(int));
+    t->syms = realloc(t->syms, sizeof(char*) * ncap / 2);
+    t->cap = ncap;
+    for (int i = 0; i < t->count; i++) {
+      unsigned long j = lenv_hash_sym(t->syms[i]) & (t->cap-1);
+      while (t->slots[j]) { j = (j+1) & (t->cap-1); }
+      t->slots[j] = i+1;
+    }
   }
 
-  /* Print a newline and delete arguments */
-  putchar('\n');
-  lval_del(a);
+  unsigned long j = lenv_hash_sym(sym) & (t->cap-1);
+  while (t->slots[j]) {
+    if (t->syms[t->slots[j]-1] == sym) { return t->slots[j]-1; }
+    j = (j+1) & (t->cap-1);
+  }
+  t->syms[t->count] = sym;
+  t->slots[j] = ++t->count;
+  return t->count-1;
+}
 
-  return lval_sexpr();
+static void lcache_put_val(limage_out* o, lcache_syms* t, lval* v) {
+  switch (lval_type(v)) {
+    case LVAL_NUM: {
+      /* Zigzag, so small negative numbers stay short */
+      uint64_t x = lval_to_num(v);
+      limage_put_tag(o, LCACHE_NUM);
+      lcache_put_uint(o, (x << 1) ^ (0 - (x >> 63)));
+      break;
+    }
+    case LVAL_SYM:
+      limage_put_tag(o, LCACHE_SYM);
+      lcache_put_uint(o, lcache_sym_index(t, v->sym));
+      break;
+    case LVAL_STR:
+      limage_put_tag(o, LCACHE_STR);
+      lcache_put_text(o, v->str, v->size);
+      break;
+    case LVAL_ERR:
+      limage_put_tag(o, LCACHE_ERR);
+      lcache_put_chars(o, v->err);
+      break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      limage_put_tag(o, lval_type(v) == LVAL_SEXPR ? LCACHE_SEXPR : LCACHE_QEXPR);
+      lcache_put_uint(o, v->count);
+      for (int i = 0; i < v->count; i++) { lcache_put_val(o, t, v->cell[i]); }
+      break;
+  }
 }
 
-lval* builtin_error(lenv* e, lval* a) {
-  LASSERT_NUM("error", a, 1);
-  LASSERT_TYPE("error", a, 0, LVAL_STR);
+static char* lcache_path(char* filename) {
+  char* path = malloc(strlen(filename) + 2);
+  strcpy(path, filename);
+  strcat(path, "c");
+  return path;
+}
 
-  /* Construct Error from first argument */
-  lval* err = lval_err(a->cell[0]->str);
+/* Write the cache for the file read from input into x. Failing to is not */
+/* an error, the file is just read from source next time too. */
+void lcache_write(char* filename, char* input, long size, lval* x) {
+  lcache_syms t = { NULL, NULL, 0, 0 };
+  limage_out body = { NULL, 0, 0 };
+  lcache_put_val(&body, &t, x);
+
+  /* The symbols and values, checked as one when read */
+  limage_out rest = { NULL, 0, 0 };
+  lcache_put_uint(&rest, t.count);
+  for (int i = 0; i < t.count; i++) { lcache_put_chars(&rest, t.syms[i]); }
+  limage_put(&rest, body.data, body.len);
+  free(t.syms);
+  free(t.slots);
+  free(body.data);
+
+  limage_out o = { NULL, 0, 0 };
+  limage_put(&o, LCACHE_MAGIC, 8);
+  lcache_put_uint(&o, LCACHE_VERSION);
+  lcache_put_chars(&o, LCACHE_BUILD);
+  lcache_put_uint(&o, size);
+  lcache_put_uint(&o, lcache_hash(input, size));
+  lcache_put_uint(&o, rest.len);
+  lcache_put_uint(&o, lcache_hash(rest.data, rest.len));
+  limage_put(&o, rest.data, rest.len);
+  free(rest.data);
+
+  char* path = lcache_path(filename);
+  /* Named for this process and thread, so loads running at once write files of their own */
+  char* tmp = malloc(strlen(path) + 64);
+  sprintf(tmp, "%s.%ld.%p.tmp", path, (long)getpid(), (void*)&lcache_thread);
+  FILE* f = fopen(tmp, "wb");
+  if (f) {
+    int ok = fwrite(o.data, 1, o.len, f) == o.len;
+    if (fclose(f) != 0) { ok = 0; }
+    if (!ok || rename(tmp, path) != 0) { remove(tmp); }
+  }
+  free(tmp);
+  free(path);
+  free(o.data);
+}
 
-  /* Delete arguments and return */
-  lval_del(a);
-  return err;
+/* The cache being read, with its symbol table once that has been read */
+typedef struct {
+  unsigned char* s;
+  unsigned char* end;
+  char** syms;
+  uint64_t count;
+} lcache_in;
+
+static int lcache_get_uint(lcache_in* in, uint64_t* x) {
+  *x = 0;
+  for (int shift = 0; shift < 64 && in->s < in->end; shift += 7) {
+    unsigned char b = *in->s++;
+    *x |= (uint64_t)(b & 127) << shift;
+    if (b < 128) { return 1; }
+  }
+  return 0;
 }
 
+/* Read a length and that many characters in place */
+static int lcache_get_chars(lcache_in* in, char** s, uint64_t* n) {
+  if (!lcache_get_uint(in, n) || *n > (uint64_t)(in->end - in->s)) { return 0; }
+  *s = (char*)in->s;
+  in->s += *n;
+  return 1;
+}
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-  lval* k = lval_sym(name);
-  lval* v = lval_builtin(func);
-  lenv_put(e, k, v);
-  lval_del(k);
-  lval_del(v);
+/* Read a value, returning NULL if the cache is corrupt */
+static lval* lcache_get_val(lcache_in* in) {
+  uint64_t x;
+  char* s;
+  if (in->s == in->end) { return NULL; }
+  int tag = *in->s++;
+
+  switch (tag) {
+    case LCACHE_NUM:
+      if (!lcache_get_uint(in, &x)) { return NULL; }
+      return lval_num((long)((x >> 1) ^ (0 - (x & 1))));
+    case LCACHE_SYM: {
+      if (!lcache_get_uint(in, &x) || x >= in->count) { return NULL; }
+      lval* v = lval_alloc(LVAL_SYM);
+      v->sym = in->syms[x];
+      v->slot = -1;
+      return v;
+    }
+    case LCACHE_STR: {
+      if (!lcache_get_chars(in, &s, &x)) { return NULL; }
+      return lval_str_len(s, x);
+    }
+    case LCACHE_ERR:
+      if (!lcache_get_chars(in, &s, &x) || x > INT_MAX) { return NULL; }
+      return lval_err("%.*s", (int)x, s);
+    case LCACHE_SEXPR:
+    case LCACHE_QEXPR: {
+      /* Every element takes at least two bytes */
+      if (!lcache_get_uint(in, &x) || x > (uint64_t)(in->end - in->s) / 2 || x > INT_MAX) { return NULL; }
+      lval* v = tag == LCACHE_SEXPR ? lval_sexpr() : lval_qexpr();
+      if (x) {
+        v->cells = lcells_new(x);
+        v->cell = v->cells->items;
+        for (uint64_t i = 0; i < x; i++) {
+          lval* y = lcache_get_val(in);
+          if (!y) { lval_del(v); return NULL; }
+          v->cells->items[v->cells->used++] = y;
+          v->count++;
+        }
+      }
+      return v;
+    }
+  }
+  return NULL;
 }
 
-void lenv_add_builtins(lenv* e) {
-  /* List Functions */
-  lenv_add_builtin(e, "list",  builtin_list);
-  lenv_add_builtin(e, "head",  builtin_head);
-  lenv_add_builtin(e, "tail",  builtin_tail);
-  lenv_add_builtin(e, "eval",  builtin_eval);
-  lenv_add_builtin(e, "join",  builtin_join);
+/* What the cache for the file read into input holds, or NULL if there is */
+/* no cache for it that can be used */
+lval* lcache_read(char* filename, char* input, long size) {
+  char* path = lcache_path(filename);
+  FILE* f = fopen(path, "rb");
+  free(path);
+  if (!f) { return NULL; }
+
+  fseek(f, 0, SEEK_END);
+  long n = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  if (n < 0) { n = 0; }
+  unsigned char* data = malloc(n + 1);
+  n = fread(data, 1, n, f);
+  fclose(f);
+
+  lcache_in in = { data, data + n, NULL, 0 };
+  lval* x = NULL;
+  uint64_t version, length, hash, rest, check;
+  char* build;
+  uint64_t build_len;
+
+  /* Check the cache was written for this source by this build */
+  if (n < 8 || memcmp(data, LCACHE_MAGIC, 8) != 0) { goto done; }
+  in.s += 8;
+  if (!lcache_get_uint(&in, &version) || version != LCACHE_VERSION
+      || !lcache_get_chars(&in, &build, &build_len)
+      || build_len != strlen(LCACHE_BUILD) || memcmp(build, LCACHE_BUILD, build_len) != 0
+      || !lcache_get_uint(&in, &length) || length != (uint64_t)size
+      || !lcache_get_uint(&in, &hash) || hash != lcache_hash(input, size)) { goto done; }
+
+  /* The rest must be intact and fill the cache */
+  if (!lcache_get_uint(&in, &rest) || !lcache_get_uint(&in, &check)
+      || rest != (uint64_t)(in.end - in.s) || check != lcache_hash((char*)in.s, rest)) { goto done; }
+
+  /* Intern the symbols once each */
+  if (!lcache_get_uint(&in, &in.count) || in.count > (uint64_t)(in.end - in.s)) { goto done; }
+  in.syms = malloc(sizeof(char*) * (in.count ? in.count : 1));
+  for (uint64_t i = 0; i < in.count; i++) {
+    char* s;
+    uint64_t len;
+    if (!lcache_get_chars(&in, &s, &len) || len == 0) { goto done; }
+    in.syms[i] = lsym_intern_n(s, len);
+  }
 
-  /* Mathematical Functions */
-  lenv_add_builtin(e, "+",     builtin_add);
-  lenv_add_builtin(e, "-",     builtin_sub);
-  lenv_add_builtin(e, "*",     builtin_mul);
-  lenv_add_builtin(e, "/",     builtin_div);
+  x = lcache_get_val(&in);
+  if (x && (in.s != in.end || lval_type(x) != LVAL_SEXPR)) {
+    lval_del(x);
+    x = NULL;
+  }
 
-  /* Variable Functions */
-  lenv_add_builtin(e, "\\",    builtin_lambda);
-  lenv_add_builtin(e, "doh",   builtin_def);
-  lenv_add_builtin(e, "=",     builtin_put);
+done:
+  free(in.syms);
+  free(data);
+  return x;
+}
 
-  /* Comparison Functions */
-  lenv_add_builtin(e, ">",     builtin_gt);
-  lenv_add_builtin(e, "<",     builtin_lt);
-  lenv_add_builtin(e, ">=",    builtin_ge);
-  lenv_add_builtin(e, "<=",    builtin_le);
-  lenv_add_builtin(e, "==",    builtin_eq);
-  lenv_add_builtin(e, "!=",    builtin_ne);
-  lenv_add_builtin(e, "if",    builtin_if);
+/* Parallel Map */
+/* pmap and preduce split a list into chunks and run them on a pool of */
+/* worker threads. Values are not shared between threads, as their reference */
+/* counts are not atomic and each thread allocates from its own pools, so */
+/* the function, the bindings it refers to where it is called and each */
+/* chunk are written out as an image is, read back by the worker into a */
+/* heap and environment of its own, and the results come back the same way. */
+/* Each worker starts on its own share of the chunks and, once that runs */
+/* out, steals chunks from the far end of the others'. The chunks depend */
+/* only on the length of the list and results are put back in chunk order, */
+/* so the result is the same however many threads there are. A pmap or */
+/* preduce called from a worker, or with a pool of one thread, runs the */
+/* same chunks in the calling thread. */
+#define LPOOL_CHUNKS 256
+
+/* The chunks one worker has left, taken from the front by the worker and */
+/* from the back by thieves */
+typedef struct {
+  pthread_mutex_t lock;
+  int next;
+  int end;
+} lpool_queue;
+
+typedef struct {
+  int reduce;            // preduce rather than pmap
+  int size;              // elements in each chunk, the last may have fewer
+  int count;             // of elements in the whole list
+  limage_out scope;      // the bindings and then the function
+  limage_out* chunks;    // each chunk of the list
+  limage_out* results;   // what each chunk gave
+  lpool_queue* queues;   // one per worker
+  int workers;
+} lpool_job;
+
+static pthread_mutex_t lpool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lpool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t lpool_done = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t lpool_run_lock = PTHREAD_MUTEX_INITIALIZER; // one job at a time
+static pthread_t* lpool_threads = NULL;
+static int lpool_size = 0;      // worker threads running
+static int lpool_want = 0;      // set with threads, 0 for one per core
+static lpool_job* lpool_current = NULL;
+static unsigned long lpool_generation = 0;
+static unsigned long lpool_started = 0; // the generation when the workers were started
+static int lpool_busy = 0;      // workers still on the current job
+static int lpool_quit = 0;
+static _Thread_local int lpool_worker = 0;
+
+/* Run f on the elements of l in [lo, hi), giving the list of results */
+static lval* lpool_map_chunk(lenv* e, lval* f, lval* l, int lo, int hi) {
+  lval* r = lval_qexpr();
+  if (hi > lo) { lval_cells_reserve(r, 0, hi - lo); }
+  for (int i = lo; i < hi; i++) {
+    lval* x = lval_elem(e, l, i);
+    if (lval_type(x) != LVAL_ERR) { x = lval_call_with(e, f, x, NULL); }
+    if (lval_type(x) == LVAL_ERR) { lval_del(r); return x; }
+    r = lval_add(r, x);
+  }
+  return r;
+}
 
-  /* String Functions */
-  lenv_add_builtin(e, "load",  builtin_load);
-  lenv_add_builtin(e, "error", builtin_error);
-  lenv_add_builtin(e, "print", builtin_print);
+/* Fold f over the elements of l in [lo, hi), starting from the first */
+static lval* lpool_reduce_chunk(lenv* e, lval* f, lval* l, int lo, int hi) {
+  lval* acc = lval_elem(e, l, lo);
+  for (int i = lo + 1; i < hi && lval_type(acc) != LVAL_ERR; i++) {
+    lval* x = lval_elem(e, l, i);
+    if (lval_type(x) == LVAL_ERR) { lval_del(acc); return x; }
+    acc = lval_call_with(e, f, acc, x);
+  }
+  return acc;
 }
 
-/* Evaluation */
-lval* lval_call(lenv* e, lval* f, lval* a) {
+/* Add what a chunk gave to the result so far, consuming both */
+static lval* lpool_combine(lenv* e, lval* f, int reduce, lval* acc, lval* x) {
+  if (lval_type(x) == LVAL_ERR) { lval_del(acc); return x; }
+  return reduce ? lval_call_with(e, f, acc, x) : lval_join(acc, x);
+}
 
-  /* If Builtin then simply call that */
-  if (f->builtin) { return f->builtin(e, a); }
+/* Take the next chunk for worker w, stealing one if its own have run out. */
+/* Returns -1 once every chunk has been taken. */
+static int lpool_take(lpool_job* j, int w) {
+  lpool_queue* q = &j->queues[w];
+  int c = -1;
+  pthread_mutex_lock(&q->lock);
+  if (q->next < q->end) { c = q->next++; }
+  pthread_mutex_unlock(&q->lock);
+
+  for (int k = 1; c < 0 && k < j->workers; k++) {
+    q = &j->queues[(w + k) % j->workers];
+    pthread_mutex_lock(&q->lock);
+    if (q->next < q->end) { c = --q->end; }
+    pthread_mutex_unlock(&q->lock);
+  }
+  return c;
+}
 
-  /* Record Argument Counts */
-  int given = a->count;
-  int total = f->formals->count;
+/* A value sent back as the result of a chunk, or an error if it cannot be */
+static void lpool_put_result(limage_out* o, lval* x) {
+  if (!limage_put_val(o, x)) {
+    o->len = 0;
+    lval* err = lval_err("Cannot send a %s back from a worker thread. Ah, sweet manatee of Galilee!",
+      ltype_name(lval_type(x)));
+    limage_put_val(o, err);
+    lval_del(err);
+  }
+  lval_del(x);
+}
 
-  /* While arguments still remain to be processed */
-  while (a->count) {
+/* Worker w's part in job j */
+static void lpool_work(lpool_job* j, int w) {
+  lenv* builtins = NULL;
+  lenv* e = NULL;
+  lval* f = NULL;
+
+  int c;
+  while ((c = lpool_take(j, w)) >= 0) {
+
+    /* Read the scope in before the first chunk, as there may be none */
+    if (!builtins) {
+      builtins = lenv_new();
+      lenv_add_builtins(builtins);
+      e = lenv_new();
+      lenv_add_builtins(e);
+      limage_in in = { j->scope.data, j->scope.data + j->scope.len, builtins };
+      if (limage_get_env(&in, e)) { f = limage_get_val(&in); }
+    }
 
-    /* If we've ran out of formal arguments to bind */
-    if (f->formals->count == 0) {
-      lval_del(a);
-      return lval_err("Function passed too many arguments? Got %i when you expected %i? Well eat my shorts!", given, total);
+    limage_in in = { j->chunks[c].data, j->chunks[c].data + j->chunks[c].len, builtins };
+    lval* l = f ? limage_get_val(&in) : NULL;
+    lval* x;
+    if (!l) {
+      x = lval_err("A worker thread could not read its work. D'oh!");
+    } else {
+      x = j->reduce ? lpool_reduce_chunk(e, f, l, 0, l->count) : lpool_map_chunk(e, f, l, 0, l->count);
+      lval_del(l);
     }
+    lpool_put_result(&j->results[c], x);
+  }
 
-    /* Pop the first symbol from the formals */
-    lval* sym = lval_pop(f->formals, 0);
+  if (f) { lval_del(f); }
+  if (e) { lenv_del(e); }
+  if (builtins) { lenv_del(builtins); }
+}
 
-    /* Special Case to deal with '&' */
-    if (strcmp(sym->sym, "&") == 0) {
+static void* lpool_main(void* arg) {
+  int w = (int)(intptr_t)arg;
+  lpool_worker = 1;
+  unsigned long seen = lpool_started;
 
-      /* Ensure '&' is followed by another symbol */
-      if (f->formals->count != 1) {
-        lval_del(a);
-        return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
-      }
+  pthread_mutex_lock(&lpool_lock);
+  for (;;) {
+    while (!lpool_quit && lpool_generation == seen) { pthread_cond_wait(&lpool_wake, &lpool_lock); }
+    if (lpool_quit) { break; }
+    seen = lpool_generation;
+    lpool_job* j = lpool_current;
+    pthread_mutex_unlock(&lpool_lock);
 
-      /* Next formal should be bound to remaining arguments */
-      lval* nsym = lval_pop(f->formals, 0);
-      lenv_put(f->env, nsym, builtin_list(e, a));
-      lval_del(sym), lval_del(nsym);
-      break;
-    }
+    lpool_work(j, w);
+    lgc_collect(-1);
 
-    /* Pop the next argument from the list */
-    lval* val = lval_pop(a, 0);
+    pthread_mutex_lock(&lpool_lock);
+    if (--lpool_busy == 0) { pthread_cond_signal(&lpool_done); }
+  }
+  pthread_mutex_unlock(&lpool_lock);
 
-    /* Bind a copy into the function's environment */
-    lenv_put(f->env, sym, val);
+  lthread_cleanup();
+  return NULL;
+}
 
-    /* Delete symbol and value */
-    lval_del(sym); lval_del(val);
-  }
+/* Stop and join the worker threads */
+void lpool_shutdown(void) {
+  pthread_mutex_lock(&lpool_lock);
+  lpool_quit = 1;
+  pthread_cond_broadcast(&lpool_wake);
+  pthread_mutex_unlock(&lpool_lock);
+  for (int i = 0; i < lpool_size; i++) { pthread_join(lpool_threads[i], NULL); }
+  free(lpool_threads);
+  lpool_threads = NULL;
+  lpool_size = 0;
+  lpool_quit = 0;
+}
 
-  /* Argument list is now bound so can be cleaned up */
-  lval_del(a);
+/* The number of threads wanted, one per core unless set with threads */
+static int lpool_wanted(void) {
+  if (lpool_want > 0) { return lpool_want; }
+  long n = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  return n > 0 ? n : 1;
+}
 
-  /* If '&' remains in formal list then bind to empty list */
-  if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0) {
+/* Start the pool at the wanted size, returning the number of workers */
+static int lpool_start(void) {
+  int want = lpool_wanted();
+  if (lpool_size == want) { return lpool_size; }
+  lpool_shutdown();
+  if (want == 1) { return 0; }
+  lpool_threads = malloc(sizeof(pthread_t) * want);
+  lpool_started = lpool_generation;
+  while (lpool_size < want
+      && pthread_create(&lpool_threads[lpool_size], NULL, lpool_main, (void*)(intptr_t)lpool_size) == 0) {
+    lpool_size++;
+  }
+  return lpool_size;
+}
 
-    /* Check to ensure that & is not passed invalidly. */
-    if (f->formals->count != 2) {
-      return lval_err("Function format invalid. Symbol '&' not followed by single symbol. Blame stupid Flanders.");
+/* The bindings a job needs: each symbol reachable from the function or */
+/* the list, whose elements the workers evaluate, and what it is bound to */
+/* where pmap was called, or NULL if nothing is to be sent for it. Only */
+/* these are written, so the cost of a job does not grow with the size of */
+/* the global environment. A symbol only built at run time, */
+/* as with eval of a list put together by the function, is not seen and */
+/* will be unbound in the workers. */
+typedef struct {
+  char** syms;
+  lval** vals;
+  int* slots;  // index+1 into syms by interned pointer, 0 if empty
+  int count;
+  int cap;     // of slots, a power of two
+  int failed;  // set if there was no memory to grow it
+} lpool_scope;
+
+/* What sym is bound to in e or its parents, or NULL */
+static lval* lpool_lookup(lenv* e, char* sym) {
+  for (; e; e = e->par) {
+    int i = lenv_find(e, sym);
+    if (i >= 0) { return e->vals[i]; }
+  }
+  return NULL;
+}
+
+/* The slot holding sym, or the empty one it would go in, growing the */
+/* scope to keep its index at most half full. -1 if there is no memory. */
+static long lpool_scope_slot(lpool_scope* s, char* sym) {
+  if (s->count * 2 >= s->cap) {
+    int ncap = s->cap ? s->cap * 2 : 64;
+    int* slots = calloc(ncap, sizeof(int));
+    char** syms = realloc(s->syms, sizeof(char*) * ncap / 2);
+    if (syms) { s->syms = syms; }
+    lval** vals = realloc(s->vals, sizeof(lval*) * ncap / 2);
+    if (vals) { s->vals = vals; }
+    if (!slots || !syms || !vals) {
+      free(slots);
+      s->failed = 1;
+      return -1;
     }
+    free(s->slots);
+    s->slots = slots;
+    s->cap = ncap;
+    for (int i = 0; i < s->count; i++) {
+      unsigned long j = lenv_hash_sym(s->syms[i]) & (s->cap-1);
+      while (s->slots[j]) { j = (j+1) & (s->cap-1); }
+      s->slots[j] = i+1;
+    }
+  }
 
-    /* Pop and delete '&' symbol */
-    lval_del(lval_pop(f->formals, 0));
+  unsigned long j = lenv_hash_sym(sym) & (s->cap-1);
+  while (s->slots[j] && s->syms[s->slots[j]-1] != sym) { j = (j+1) & (s->cap-1); }
+  return j;
+}
 
-    /* Pop next symbol and create empty list */
-    lval* sym = lval_pop(f->formals, 0);
-    lval* val = lval_qexpr();
+/* Add each symbol in v to the scope, and those in what it is bound to. */
+/* Builtins still bound to their own names are left out, as every worker */
+/* environment starts with them. Formals are skipped, as calls bind them. */
+static void lpool_scope_add(lpool_scope* s, lenv* e, lval* v) {
+  switch (lval_type(v)) {
+    case LVAL_SYM: {
+      long j = lpool_scope_slot(s, v->sym);
+      if (j < 0 || s->slots[j]) { return; }
+      lval* x = lpool_lookup(e, v->sym);
+      if (x && lval_type(x) == LVAL_FUN && x->builtin && x->name == v->sym) { x = NULL; }
+      s->syms[s->count] = v->sym;
+      s->vals[s->count] = x;
+      s->slots[j] = ++s->count;
+      if (x) { lpool_scope_add(s, e, x); }
+      return;
+    }
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      for (int i = 0; i < v->count; i++) { lpool_scope_add(s, e, v->cell[i]); }
+      return;
+    case LVAL_MAP:
+      for (int i = 0; i < v->upto; i++) {
+        if (lmap_live(v, i)) { lpool_scope_add(s, e, v->map->entries[i].val); }
+      }
+      return;
+    case LVAL_FUN:
+      if (lval_is_memo(v)) {
+        lpool_scope_add(s, e, lmemo_fn(v->memo));
+      } else if (!v->builtin) {
+        lpool_scope_add(s, e, v->body);
+        for (int i = 0; i < v->env->count; i++) { lpool_scope_add(s, e, v->env->vals[i]); }
+      }
+      return;
+  }
+}
 
-    /* Bind to environment and delete */
-    lenv_put(f->env, sym, val);
-    lval_del(sym); lval_del(val);
+/* Write the scope as an environment, returning the name of a value that */
+/* cannot be written, or NULL */
+static char* lpool_put_scope(limage_out* o, lpool_scope* s) {
+  int n = 0;
+  for (int i = 0; i < s->count; i++) { n += s->vals[i] != NULL; }
+  limage_put_int(o, n);
+  for (int i = 0; i < s->count; i++) {
+    if (!s->vals[i]) { continue; }
+    limage_put_str(o, s->syms[i]);
+    if (!limage_put_val(o, s->vals[i])) { return s->syms[i]; }
   }
+  return NULL;
+}
 
-  /* If all formals have been bound then evaluate */
-  if (f->formals->count == 0) {
+/* Run f over the list l on the pool, or in this thread if it cannot be */
+static lval* lpool_run(lenv* e, lval* f, lval* l, lval* init, int reduce) {
+  if (!l->count) { return init; }
+  int size = (l->count + LPOOL_CHUNKS - 1) / LPOOL_CHUNKS;
+  int chunks = (l->count + size - 1) / size;
+
+  int workers = 0;
+  if (!lpool_worker) {
+    pthread_mutex_lock(&lpool_run_lock);
+    workers = lpool_start();
+    if (workers <= 1) { pthread_mutex_unlock(&lpool_run_lock); }
+  }
+  if (workers <= 1) {
+    lval* acc = init;
+    for (int c = 0; c < chunks && lval_type(acc) != LVAL_ERR; c++) {
+      int lo = c * size, hi = lo + size < l->count ? lo + size : l->count;
+      lval* x = reduce ? lpool_reduce_chunk(e, f, l, lo, hi) : lpool_map_chunk(e, f, l, lo, hi);
+      acc = lpool_combine(e, f, reduce, acc, x);
+    }
+    return acc;
+  }
 
-    /* Set environment parent to evaluation environment */
-    f->env->par = e;
+  /* Write out everything the workers need */
+  lpool_job j = { reduce, size, l->count, { NULL, 0, 0 } };
+  lpool_scope scope = { NULL, NULL, NULL, 0, 0, 0 };
+  lpool_scope_add(&scope, e, f);
+  lpool_scope_add(&scope, e, l);
+  char* bad = scope.failed ? "the bindings" : lpool_put_scope(&j.scope, &scope);
+  free(scope.syms);
+  free(scope.vals);
+  free(scope.slots);
+  if (bad || !limage_put_val(&j.scope, f)) {
+    pthread_mutex_unlock(&lpool_run_lock);
+    free(j.scope.data);
+    lval_del(init);
+    return lval_err("Cannot send '%s' to a worker thread. Ah, sweet manatee of Galilee!",
+      bad ? bad : "the function");
+  }
 
-    /* Evaluate and return */
-    return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-  } else {
-    /* Otherwise return partially evaluated function */
-    return lval_copy(f);
+  j.chunks = calloc(chunks, sizeof(limage_out));
+  j.results = calloc(chunks, sizeof(limage_out));
+  for (int c = 0; c < chunks; c++) {
+    int lo = c * size, hi = lo + size < l->count ? lo + size : l->count;
+    limage_put_tag(&j.chunks[c], LIMAGE_QEXPR);
+    limage_put_int(&j.chunks[c], hi - lo);
+    for (int i = lo; i < hi; i++) {
+      if (!limage_put_val(&j.chunks[c], l->cell[i])) { bad = "the list"; }
+    }
   }
-}
 
-/* Evaluate an S-Expression */
-lval* lval_eval_sexpr(lenv* e, lval* v) {
+  /* Share the chunks out evenly to begin with */
+  j.workers = workers;
+  j.queues = malloc(sizeof(lpool_queue) * workers);
+  for (int w = 0; w < workers; w++) {
+    pthread_mutex_init(&j.queues[w].lock, NULL);
+    j.queues[w].next = (long)chunks * w / workers;
+    j.queues[w].end = (long)chunks * (w + 1) / workers;
+  }
 
-  /* Evaluate Children */
-  for (int i = 0; i < v->count; i++) {
-    v->cell[i] = lval_eval(e, v->cell[i]); // recursively evaluate each child lval to handle nested expressions
+  /* Run the job */
+  if (!bad) {
+    pthread_mutex_lock(&lpool_lock);
+    lpool_current = &j;
+    lpool_busy = workers;
+    lpool_generation++;
+    pthread_cond_broadcast(&lpool_wake);
+    while (lpool_busy > 0) { pthread_cond_wait(&lpool_done, &lpool_lock); }
+    lpool_current = NULL;
+    pthread_mutex_unlock(&lpool_lock);
   }
+  pthread_mutex_unlock(&lpool_run_lock);
 
-  /* Error Checking */
-  for (int i = 0; i < v->count; i++) {
-    if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+  /* Put the results together in order */
+  lval* acc = init;
+  if (bad) {
+    lval_del(acc);
+    acc = lval_err("Cannot send '%s' to a worker thread. Ah, sweet manatee of Galilee!", bad);
+  }
+  lenv* builtins = NULL;
+  for (int c = 0; c < chunks && lval_type(acc) != LVAL_ERR; c++) {
+    if (!builtins) {
+      builtins = lenv_new();
+      lenv_add_builtins(builtins);
+    }
+    limage_in in = { j.results[c].data, j.results[c].data + j.results[c].len, builtins };
+    lval* x = limage_get_val(&in);
+    if (!x) { x = lval_err("A worker thread gave no result. D'oh!"); }
+    acc = lpool_combine(e, f, reduce, acc, x);
   }
+  if (builtins) { lenv_del(builtins); }
 
-  /* Empty Expression. Return as it is */
-  if (v->count == 0) { return v; }
+  for (int c = 0; c < chunks; c++) {
+    free(j.chunks[c].data);
+    free(j.results[c].data);
+  }
+  for (int w = 0; w < workers; w++) { pthread_mutex_destroy(&j.queues[w].lock); }
+  free(j.queues);
+  free(j.chunks);
+  free(j.results);
+  free(j.scope.data);
+  return acc;
+}
 
-  /* Single Expression. Return it directly */
-  if (v->count == 1) { return lval_take(v, 0); }
+/* map, run in parallel */
+lval* builtin_pmap(lenv* e, lval* a) {
+  LASSERT_NUM("pmap", a, 2);
+  LASSERT_TYPE("pmap", a, 0, LVAL_FUN);
+  LASSERT_TYPE("pmap", a, 1, LVAL_QEXPR);
 
-  /* Ensure first element is a Function after Evaluation */
-  lval* f = lval_pop(v, 0);
-  if (f->type != LVAL_FUN) {
-    lval* err = lval_err(
-      "S-Expression starts with incorrect type. "
-          "Got %s, Expected %s. Don't blame me, I voted for Haskell.",
-           ltype_name(f->type), ltype_name(LVAL_FUN));
-           lval_del(f), lval_del(v);
-           return err;
+  lval* r = lpool_run(e, a->cell[0], a->cell[1], lval_qexpr(), 0);
+  lval_del(a);
+  return r;
+}
+
+/* foldleft, run in parallel. Each chunk is folded on its own and the */
+/* results folded into the starting value, so the function must be */
+/* associative to give what foldleft would. */
+lval* builtin_preduce(lenv* e, lval* a) {
+  LASSERT_NUM("preduce", a, 3);
+  LASSERT_TYPE("preduce", a, 0, LVAL_FUN);
+  LASSERT_TYPE("preduce", a, 2, LVAL_QEXPR);
+
+  lval* r = lpool_run(e, a->cell[0], a->cell[2], lval_copy(a->cell[1]), 1);
+  lval_del(a);
+  return r;
+}
+
+/* Set the number of worker threads, 0 for one per core */
+lval* builtin_threads(lenv* e, lval* a) {
+  LASSERT_NUM("threads", a, 1);
+  LASSERT_TYPE("threads", a, 0, LVAL_NUM);
+  LASSERT(a, lval_to_num(a->cell[0]) >= 0 && lval_to_num(a->cell[0]) <= 1024,
+    "Function 'threads' needs between 0 and 1024 threads. Got %li.", lval_to_num(a->cell[0]));
+
+  /* The thread running the job holds the lock until every worker is done */
+  LASSERT(a, !lpool_worker, "Function 'threads' cannot be called from a worker thread. D'oh!");
+
+  pthread_mutex_lock(&lpool_run_lock);
+  lpool_want = lval_to_num(a->cell[0]);
+  pthread_mutex_unlock(&lpool_run_lock);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* Interpreters */
+/* An interpreter is its global environment. Everything else it uses, its */
+/* heap, symbols and collector, belongs to the thread running it, and no */
+/* value is ever shared between threads, so interpreters on different */
+/* threads run at once without locking anything. Interpreters on the same */
+/* thread share that thread's heap but nothing they can see. An interpreter */
+/* is deleted once it is finished with, and the thread cleaned up with */
+/* lthread_cleanup once it has deleted every interpreter it ran. */
+struct sneed {
+  lenv* env;
+};
+typedef struct sneed linterp;
+
+linterp* linterp_new(void) {
+  linterp* in = malloc(sizeof(linterp));
+  in->env = lenv_new();
+  lenv_add_builtins(in->env);
+  return in;
+}
+
+void linterp_del(linterp* in) {
+  lenv_del(in->env);
+  free(in);
+}
+
+/* Load the named file into the interpreter, as load does */
+lval* linterp_load(linterp* in, char* filename) {
+  return builtin_load(in->env, lval_add(lval_sexpr(), lval_str(filename)));
+}
+
+/* Isolates */
+/* --isolates=N runs the files given in N interpreters at once, each on a */
+/* thread of its own, and reports how long they took and how many failed. */
+typedef struct {
+  char** files;
+  int count;
+  int failed;
+} lisolate;
+
+static void* lisolate_main(void* arg) {
+  lisolate* iso = arg;
+  linterp* in = linterp_new();
+  for (int i = 0; i < iso->count; i++) {
+    lval* x = linterp_load(in, iso->files[i]);
+    if (lval_type(x) == LVAL_ERR) {
+      lval_println(x);
+      iso->failed = 1;
     }
+    lval_del(x);
+  }
+  linterp_del(in);
+  lthread_cleanup();
+  return NULL;
+}
 
-  /* If so, call function to get result */
-  lval* result = lval_call(e, f, v);
-  lval_del(f);
-  return result;
+/* Returns the number of isolates that failed */
+int lisolate_run(int n, char** files, int count) {
+  lisolate* isos = calloc(n, sizeof(lisolate));
+  pthread_t* threads = malloc(sizeof(pthread_t) * n);
+  double start = lgc_now_us();
+
+  int started = 0;
+  for (; started < n; started++) {
+    isos[started].files = files;
+    isos[started].count = count;
+    if (pthread_create(&threads[started], NULL, lisolate_main, &isos[started]) != 0) { break; }
+  }
+
+  int failed = n - started;
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+    failed += isos[i].failed;
+  }
+  fprintf(stderr, "%d isolates ran in %.1f ms, %d failed\n", n, (lgc_now_us() - start) / 1e3, failed);
+
+  free(threads);
+  free(isos);
+  return failed;
 }
 
-/* Evaluate an lval */
-lval* lval_eval(lenv* e, lval* v) {
-  if (v->type == LVAL_SYM) { // if it's a symbol, we need to look it up in the environment
-    lval* x = lenv_get(e, v);
-    lval_del(v);
-    return x;
+/* Library Interface */
+/* What src/sneed.h declares. Values are handed out as they are, so a */
+/* sneed_val* is an lval*, and an interpreter is a linterp. */
+sneed* sneed_new(void) { return linterp_new(); }
+
+void sneed_free(sneed* s) { linterp_del(s); }
+
+void sneed_thread_cleanup(void) { lthread_cleanup(); }
+
+/* Evaluate each expression in the list x in turn, consuming it, */
+/* stopping at the first error */
+static lval* sneed_eval_all(sneed* s, lval* x) {
+  lval* r = lval_sexpr();
+  while (x->count && lval_type(r) != LVAL_ERR) {
+    lval_del(r);
+    r = lval_eval(s->env, lval_pop(x, 0));
   }
-  if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); } // if it's a sexpr, we need to evaluate it
-  // everything else is a no-op
-  return v;
+  lval_del(x);
+  return r;
+}
+
+sneed_val* sneed_eval(sneed* s, const char* name, const char* source) {
+  lval* x = lval_read((char*)(name ? name : "<string>"), (char*)source);
+  if (lval_type(x) == LVAL_ERR) { return (sneed_val*)x; }
+  return (sneed_val*)sneed_eval_all(s, x);
 }
 
-lval* lval_read_num(mpc_ast_t* t) {
-  /* Check if the number is actually a valid long integer */
-  errno = 0;
-  long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ? lval_num(x) : lval_err("Invalid number! Smithers! Release the hounds!");
+sneed_val* sneed_load(sneed* s, const char* filename) {
+  return (sneed_val*)linterp_load(s, (char*)filename);
 }
 
-lval* lval_read_str(mpc_ast_t* t) {
+sneed_val* sneed_read(sneed* s, const char* name, const char* source) {
+  return (sneed_val*)lval_read((char*)(name ? name : "<string>"), (char*)source);
+}
 
-  /* Cut off the final quote character */
-  t->contents[strlen(t->contents)-1] = '\0';
+/* Evaluating a copy leaves the expression shared, so it is compiled */
+/* the first time and the compiled code reused after that */
+sneed_val* sneed_eval_value(sneed* s, sneed_val* expr) {
+  return (sneed_val*)lval_eval(s->env, lval_copy((lval*)expr));
+}
 
-  /* Copy the string missing out the first quote character */
-  char* unescaped = malloc(strlen(t->contents+1) + 1);
-  strcpy(unescaped, t->contents+1);
+int sneed_eval_batch(sneed* s, sneed_val** exprs, int n, sneed_val** results) {
+  int errors = 0;
+  for (int i = 0; i < n; i++) {
+    lval* r = lval_eval(s->env, lval_copy((lval*)exprs[i]));
+    errors += lval_type(r) == LVAL_ERR;
+    results[i] = (sneed_val*)r;
+  }
+  return errors;
+}
 
-  /* Pass through the unescape function */
-  unescaped = mpcf_unescape(unescaped);
+sneed_val* sneed_call(sneed* s, const char* name, sneed_val** args, int n) {
+  lval* k = lval_sym((char*)name);
+  lval* f = lenv_get(s->env, k);
+  lval_del(k);
+  if (lval_type(f) == LVAL_ERR) { return (sneed_val*)f; }
+  if (lval_type(f) != LVAL_FUN) {
+    lval_del(f);
+    return (sneed_val*)lval_err("'%s' is not a function. Don't blame me, I voted for Haskell.", name);
+  }
 
-  /* Construct a new lval using the string */
-  lval* str = lval_str(unescaped);
+  lval* a = lval_sexpr();
+  for (int i = 0; i < n; i++) { a = lval_add(a, lval_copy((lval*)args[i])); }
+  lval* r = lval_call(s->env, f, a);
+  lval_del(f);
+  return (sneed_val*)r;
+}
 
-  /* Free the string and return */
-  free(unescaped);
-  return str;
+void sneed_define(sneed* s, const char* name, sneed_val* v) {
+  lval* k = lval_sym((char*)name);
+  lenv_def(s->env, k, (lval*)v);
+  lval_del(k);
 }
 
-lval* lval_read(mpc_ast_t* t) {
+sneed_val* sneed_number(long n) { return (sneed_val*)lval_num(n); }
+sneed_val* sneed_string(const char* str) { return (sneed_val*)lval_str((char*)str); }
+sneed_val* sneed_symbol(const char* sym) { return (sneed_val*)lval_sym((char*)sym); }
+sneed_val* sneed_qexpr(void) { return (sneed_val*)lval_qexpr(); }
+
+/* l may be shared, with a binding or another value the caller holds, so */
+/* it is copied first unless this was the last reference to it */
+sneed_val* sneed_append(sneed_val* l, sneed_val* x) {
+  lval* v = (lval*)l;
+  int t = lval_type(v);
+  if (t != LVAL_SEXPR && t != LVAL_QEXPR) {
+    lval_del(v);
+    lval_del((lval*)x);
+    return (sneed_val*)lval_err("sneed_append passed incorrect type. Got %s, Expected Q-Expression.", ltype_name(t));
+  }
+  return (sneed_val*)lval_add(lval_mut(v), (lval*)x);
+}
 
-  /* If Symbol or Number return conversion to that type */
-  if (strstr(t->tag, "number")) { return lval_read_num(t); }
-  if (strstr(t->tag, "string")) { return lval_read_str(t); }
-  if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+int sneed_type(sneed_val* v) { return lval_type((lval*)v); }
 
-  /* If root (>) or sexpr or qexpr then create empty list */
-  lval* x = NULL;
-  if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); } // "Outer" expression is functionally the same as a sexpr or qexpr
-  if (strstr(t->tag, "sexpr"))  { x = lval_sexpr(); }
-  if (strstr(t->tag, "qexpr"))  { x = lval_qexpr(); }
+long sneed_to_number(sneed_val* v) {
+  return lval_type((lval*)v) == LVAL_NUM ? lval_to_num((lval*)v) : 0;
+}
 
-  /* Fill this list with any valid expression contained within */
-  for (int i = 0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") == 0) { continue; } // skip if any of these 6
-    if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-    if (strcmp(t->children[i]->tag,  "regex") == 0) { continue; }
-    if (strcmp(t->children[i]->tag, "comment") == 0) { continue; }
+const char* sneed_to_string(sneed_val* v) {
+  lval* x = (lval*)v;
+  switch (lval_type(x)) {
+    case LVAL_STR: return lval_str_cstr(x);
+    case LVAL_SYM: return x->sym;
+    case LVAL_ERR: return x->err;
+  }
+  return NULL;
+}
 
-    x = lval_add(x, lval_read(t->children[i])); // Otherwise we add the child to our list, which is done from inside first
+int sneed_count(sneed_val* v) {
+  lval* x = (lval*)v;
+  switch (lval_type(x)) {
+    case LVAL_SEXPR: case LVAL_QEXPR: return x->count;
+    case LVAL_VEC: return x->len;
   }
+  return 0;
+}
 
-  return x;
+sneed_val* sneed_item(sneed_val* v, int i) {
+  lval* x = (lval*)v;
+  if (i < 0 || i >= sneed_count(v)) { return NULL; }
+  if (lval_type(x) == LVAL_VEC) { return (sneed_val*)lval_num(x->data[i]); }
+  return (sneed_val*)lval_copy(x->cell[i]);
 }
 
+sneed_val* sneed_show(sneed_val* v) { return (sneed_val*)lval_show((lval*)v); }
+
+void sneed_release(sneed_val* v) { lval_del((lval*)v); }
+
+#ifndef SNEED_LIBRARY
 int main(int argc, char** argv) {
 
-  Number  = mpc_new("number");
-  Symbol  = mpc_new("symbol");
-  String  = mpc_new("string");
-  Comment = mpc_new("comment");
-  Sexpr   = mpc_new("sexpr");
-  Qexpr   = mpc_new("qexpr");
-  Expr    = mpc_new("expr");
-  Sneed   = mpc_new("sneed");
-
-  mpca_lang(MPCA_LANG_DEFAULT,
-    "                                                     \
-    number : /-?[0-9]+/ ;                               \
-    symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;         \
-    string  : /\"(\\\\.|[^\"])*\"/ ;                    \
-    comment : /;[^\\r\\n]*/ ;                           \
-    sexpr  : '(' <expr>* ')' ;                          \
-    qexpr  : '{' <expr>* '}' ;                          \
-    expr   : <number>  | <symbol> | <string>            \
-           | <comment> | <sexpr>  | <qexpr> ;           \
-    sneed  : /^/ <expr>* /$/ ;                          \
-  ",
-  Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Sneed);
-
-  lenv* e = lenv_new();
-  lenv_add_builtins(e);
+  linterp* in = linterp_new();
+
+  /* Options come before the files. --profile prints a profile of the */
+  /* whole run to stderr at exit, and --profile=FILE writes folded stacks */
+  /* to FILE too. --mem-stats prints the memory accounting at exit, once */
+  /* everything has been freed, so anything still live has leaked. */
+  /* --image=FILE starts from the environment saved in an image, and */
+  /* --dump-image=FILE saves the environment once the files are loaded. */
+  /* --no-cache makes load read every file from source, without caching. */
+  /* --threads=N sets the number of threads pmap and preduce use. */
+  /* --isolates=N runs the files in N new interpreters at once instead. */
+  char* folded = NULL;
+  char* dump = NULL;
+  int mem_stats = 0;
+  int isolates = 0;
+  int first = 1;
+  for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++) {
+    if (strncmp(argv[first], "--image=", 8) == 0) {
+      lval* x = limage_read(in->env, argv[first] + 8);
+      if (lval_type(x) == LVAL_ERR) { lval_println(x); return 1; }
+      lval_del(x);
+    } else if (strncmp(argv[first], "--dump-image=", 13) == 0) {
+      dump = argv[first] + 13;
+    } else if (strncmp(argv[first], "--threads=", 10) == 0) {
+      char* end;
+      long n = strtol(argv[first] + 10, &end, 10);
+      if (end == argv[first] + 10 || *end || n < 0 || n > 1024) {
+        fprintf(stderr, "Invalid thread count '%s'\n", argv[first] + 10);
+        return 1;
+      }
+      lpool_want = n;
+    } else if (strncmp(argv[first], "--isolates=", 11) == 0) {
+      isolates = atoi(argv[first] + 11);
+      if (isolates <= 0) {
+        fprintf(stderr, "Invalid isolate count '%s'\n", argv[first] + 11);
+        return 1;
+      }
+    } else if (strcmp(argv[first], "--no-cache") == 0) {
+      lcache_on = 0;
+    } else if (strcmp(argv[first], "--mem-stats") == 0) {
+      mem_stats = 1;
+    } else if (strcmp(argv[first], "--profile") == 0) {
+      lprof_on = 1;
+    } else if (strncmp(argv[first], "--profile=", 10) == 0) {
+      lprof_on = 1;
+      folded = argv[first] + 10;
+    } else {
+      fprintf(stderr, "Unknown option '%s'\n", argv[first]);
+      return 1;
+    }
+  }
+
+  if (isolates) {
+    int failed = lisolate_run(isolates, argv + first, argc - first);
+    lpool_shutdown();
+    linterp_del(in);
+    lthread_cleanup();
+    return failed ? 1 : 0;
+  }
 
   /* Interactive Prompt */
-  if (argc == 1) {
+  if (first == argc && !dump) {
     puts("The Sneed Programming Language V1.0");
     puts("Press Ctrl+c to Exit\n");
 
@@ -1076,46 +5731,56 @@ int main(int argc, char** argv) {
       char* input = readline("sneed> ");
       add_history(input);
 
-      mpc_result_t r;
-      if (mpc_parse("<stdin>", input, Sneed, &r)) {
-        lval* x = lval_eval(e, lval_read(r.output)); // first we read the AST into an lval, then we evaluate that lval
-        lval_println(x);
-        lval_del(x);
-
-        mpc_ast_delete(r.output);
-      } else {
-        mpc_err_print(r.error);
-        mpc_err_delete(r.error);
-      }
+      lval* x = lval_read("<stdin>", input); // first we read the input into an lval, then we evaluate that lval
+      if (lval_type(x) != LVAL_ERR) { x = lval_eval(in->env, x); }
+      lval_println(x);
+      lval_del(x);
 
       free(input);
     }
   }
 
   /* Supplied with list of files */
-  if (argc >= 2) {
-
-    /* Loop over each supplied filename (starting from 1) */
-    for (int i = 1; i < argc; i++) {
+  if (first < argc) {
 
-      /* Argument list with a single argument, the filename */
-      lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
+    /* Loop over each supplied filename */
+    for (int i = first; i < argc; i++) {
 
-      /* Pass to builtin load and get the result */
-      lval* x = builtin_load(e, args);
+      /* Load it as builtin load does and get the result */
+      lval* x = linterp_load(in, argv[i]);
 
       /* If the result is an error, be sure to print it */
-      if (x->type == LVAL_ERR) { lval_println(x); }
+      if (lval_type(x) == LVAL_ERR) { lval_println(x); }
       lval_del(x);
     }
   }
 
-  lenv_del(e);
+  if (dump) {
+    lval* x = limage_write(in->env, dump);
+    if (lval_type(x) == LVAL_ERR) { lval_println(x); }
+    lval_del(x);
+  }
+
+  if (lprof_on) {
+    lprof_on = 0;
+    lprof_print_flat(stderr);
+    if (folded && !lprof_write_folded(folded)) {
+      fprintf(stderr, "Could not write the profile to '%s'\n", folded);
+    }
+    lprof_reset();
+  }
+
+  lpool_shutdown();
+  linterp_del(in);
 
-  mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Sneed);
+  lgc_cleanup();
+  if (mem_stats) { lmem_print_stats(stderr); }
+  lsym_cleanup();
+  lmem_cleanup();
 
   return 0;
 }
+#endif
 
 
 // Note: I am aware that it is preferrable to have the pointer on the variable side of the type declaration.
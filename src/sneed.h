@@ -0,0 +1,88 @@
+/* libsneed */
+/* The Sneed interpreter as a library, built with "make lib" into */
+/* bin/libsneed.a and bin/libsneed.so. */
+/* */
+/* An interpreter, and every value it gives, belongs to the thread that */
+/* created it, and must only be used on that thread. Interpreters on */
+/* different threads run at once without sharing anything. A thread that */
+/* is finished with every interpreter and value it made calls */
+/* sneed_thread_cleanup to free what they used. */
+/* */
+/* Every value returned is owned by the caller, and is released with */
+/* sneed_release. Values passed in are only borrowed unless a function */
+/* says it takes them. */
+#ifndef SNEED_H
+#define SNEED_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define SNEED_API __attribute__((visibility("default")))
+#else
+#define SNEED_API
+#endif
+
+typedef struct sneed sneed;
+typedef struct sneed_val sneed_val;
+
+/* Types of value, in the order the interpreter numbers them */
+enum { SNEED_ERROR, SNEED_NUMBER, SNEED_SYMBOL, SNEED_STRING, SNEED_FUNCTION,
+  SNEED_SEXPR, SNEED_QEXPR, SNEED_VECTOR, SNEED_MAP };
+
+/* Interpreters */
+SNEED_API sneed* sneed_new(void);
+SNEED_API void sneed_free(sneed* s);
+SNEED_API void sneed_thread_cleanup(void);
+
+/* Evaluate every expression in the source, giving the result of the last, */
+/* or the first error. name is used in syntax errors. */
+SNEED_API sneed_val* sneed_eval(sneed* s, const char* name, const char* source);
+
+/* Load a file, as load does */
+SNEED_API sneed_val* sneed_load(sneed* s, const char* filename);
+
+/* Read the source without evaluating it, giving an S-Expression holding */
+/* each expression in it, or an error. Expressions read once are */
+/* evaluated faster each time after the first. */
+SNEED_API sneed_val* sneed_read(sneed* s, const char* name, const char* source);
+
+/* Evaluate one expression, such as one read by sneed_read */
+SNEED_API sneed_val* sneed_eval_value(sneed* s, sneed_val* expr);
+
+/* Evaluate n expressions in order, putting what each gave in results. */
+/* Returns the number that gave errors. */
+SNEED_API int sneed_eval_batch(sneed* s, sneed_val** exprs, int n, sneed_val** results);
+
+/* Call the function bound to name with n arguments */
+SNEED_API sneed_val* sneed_call(sneed* s, const char* name, sneed_val** args, int n);
+
+/* Bind name to v in the global environment */
+SNEED_API void sneed_define(sneed* s, const char* name, sneed_val* v);
+
+/* Values from C */
+SNEED_API sneed_val* sneed_number(long n);
+SNEED_API sneed_val* sneed_string(const char* str);
+SNEED_API sneed_val* sneed_symbol(const char* sym);
+SNEED_API sneed_val* sneed_qexpr(void);
+
+/* Add x to the end of the list l, taking both. Returns the list, or an */
+/* error if l is not a list. */
+SNEED_API sneed_val* sneed_append(sneed_val* l, sneed_val* x);
+
+/* Values to C */
+SNEED_API int sneed_type(sneed_val* v);
+SNEED_API long sneed_to_number(sneed_val* v);           // 0 unless a number
+SNEED_API const char* sneed_to_string(sneed_val* v);    // the text of a string, symbol or error, else NULL
+SNEED_API int sneed_count(sneed_val* v);                // elements of a list or vector, else 0
+SNEED_API sneed_val* sneed_item(sneed_val* v, int i);   // element i of a list or vector
+SNEED_API sneed_val* sneed_show(sneed_val* v);          // a string of v as print writes it
+
+SNEED_API void sneed_release(sneed_val* v);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif